@@ -0,0 +1,208 @@
+#include "AnalysisCache.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "WyvernAnalysisCache"
+
+using namespace llvm;
+
+static cl::opt<std::string> WyvernCacheDir(
+    "wylazy-cache-dir", cl::init(""),
+    cl::desc("Wyvern - Directory where the results of the Wyvern analyses are "
+             "cached across builds (no cache by default)."));
+
+/// Version of the format of the cache files.
+static constexpr StringLiteral CacheVersion = "wyvern-cache 5";
+
+/// Prints the value of option @param name, of type @param T, if it is
+/// registered.
+template <typename T>
+static void printOption(raw_ostream &OS, StringRef name) {
+  StringMap<cl::Option *> &options = cl::getRegisteredOptions();
+  auto it = options.find(name);
+  if (it != options.end()) {
+    OS << ' ' << name << '='
+       << static_cast<cl::opt<T> *>(it->second)->getValue();
+  }
+}
+
+/// Returns the header of the cache files: the version of their format and the
+/// values of the options that change the results of the Wyvern analyses.
+/// Files with other headers are ignored and overwritten, so results computed
+/// with other options are never reused.
+static std::string getCacheHeader() {
+  std::string header;
+  raw_string_ostream OS(header);
+  OS << CacheVersion;
+  printOption<bool>(OS, "wylazy-memo");
+  printOption<bool>(OS, "wylazy-adaptive-memo");
+  printOption<bool>(OS, "wylazy-pgo");
+  printOption<std::string>(OS, "wylazy-pgo-file");
+  printOption<double>(OS, "wylazy-pgo-threshold");
+  printOption<unsigned>(OS, "wylazy-capture-min-size");
+  printOption<unsigned>(OS, "wylazy-max-eager-values");
+  return OS.str();
+}
+
+AnalysisCache::AnalysisCache(StringRef dir)
+    : _dir(dir), _header(getCacheHeader()) {}
+
+AnalysisCache *AnalysisCache::get() {
+  if (WyvernCacheDir.empty()) {
+    return nullptr;
+  }
+  static AnalysisCache cache(WyvernCacheDir);
+  return &cache;
+}
+
+std::string AnalysisCache::getPath(StringRef hash) const {
+  SmallString<128> path(_dir);
+  sys::path::append(path, hash + ".wyvern");
+  return std::string(path.str());
+}
+
+AnalysisCache::Entry &AnalysisCache::lookup(StringRef hash) {
+  auto [it, inserted] = _entries.try_emplace(hash);
+  Entry &entry = it->second;
+  if (!inserted) {
+    return entry;
+  }
+
+  auto buffer = MemoryBuffer::getFile(getPath(hash));
+  if (!buffer) {
+    return entry;
+  }
+
+  SmallVector<StringRef> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+  if (lines.empty() || lines[0] != _header) {
+    return entry;
+  }
+
+  for (StringRef line : drop_begin(lines)) {
+    auto [kind, rest] = line.split(' ');
+    if (kind == "promising") {
+      SmallVector<int> promisingArgs;
+      SmallVector<StringRef> fields;
+      rest.split(fields, ' ', -1, false);
+      for (StringRef field : fields) {
+        int index;
+        if (!field.getAsInteger(10, index)) {
+          promisingArgs.push_back(index);
+        }
+      }
+      entry.promisingArgs = std::move(promisingArgs);
+    } else if (kind == "outline") {
+      // outline <call site> <argument> 0 <key> <reason...>
+      SmallVector<StringRef> fields;
+      rest.split(fields, ' ', 4, false);
+      unsigned callSite, argIdx, canOutline;
+      if (fields.size() < 3 || fields[0].getAsInteger(10, callSite) ||
+          fields[1].getAsInteger(10, argIdx) ||
+          fields[2].getAsInteger(10, canOutline) || canOutline) {
+        continue;
+      }
+      OutlineVerdict verdict{false, "", ""};
+      if (fields.size() > 3) {
+        verdict.Key = fields[3].str();
+      }
+      if (fields.size() > 4) {
+        verdict.Reason = fields[4].str();
+      }
+      entry.verdicts[{callSite, argIdx}] = std::move(verdict);
+    }
+  }
+  return entry;
+}
+
+Optional<SmallVector<int>> AnalysisCache::getPromisingArgs(StringRef hash) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return lookup(hash).promisingArgs;
+}
+
+void AnalysisCache::setPromisingArgs(StringRef hash,
+                                     ArrayRef<int> promisingArgs) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  Entry &entry = lookup(hash);
+  entry.promisingArgs = SmallVector<int>(promisingArgs.begin(),
+                                         promisingArgs.end());
+  entry.dirty = true;
+}
+
+Optional<OutlineVerdict> AnalysisCache::getOutlineVerdict(StringRef hash,
+                                                          unsigned callSite,
+                                                          unsigned argIdx) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  Entry &entry = lookup(hash);
+  auto it = entry.verdicts.find({callSite, argIdx});
+  if (it == entry.verdicts.end()) {
+    return None;
+  }
+  return it->second;
+}
+
+void AnalysisCache::setOutlineVerdict(StringRef hash, unsigned callSite,
+                                      unsigned argIdx, OutlineVerdict verdict) {
+  if (verdict.CanOutline) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(_mutex);
+  Entry &entry = lookup(hash);
+  entry.verdicts[{callSite, argIdx}] = std::move(verdict);
+  entry.dirty = true;
+}
+
+void AnalysisCache::flush() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (std::error_code EC = sys::fs::create_directories(_dir)) {
+    errs() << "Wyvern: could not create cache directory " << _dir << ": "
+           << EC.message() << "\n";
+    return;
+  }
+
+  for (auto &item : _entries) {
+    Entry &entry = item.second;
+    if (!entry.dirty) {
+      continue;
+    }
+    entry.dirty = false;
+
+    std::string path = getPath(item.first());
+    Expected<sys::fs::TempFile> temp =
+        sys::fs::TempFile::create(path + ".tmp%%%%%%");
+    if (!temp) {
+      Error E = temp.takeError();
+      LLVM_DEBUG(dbgs() << "Could not create temporary file for " << path
+                        << ": " << toString(std::move(E)) << "\n");
+      consumeError(std::move(E));
+      continue;
+    }
+
+    {
+      raw_fd_ostream os(temp->FD, /*shouldClose=*/false);
+      os << _header << "\n";
+      if (entry.promisingArgs) {
+        os << "promising";
+        for (int index : *entry.promisingArgs) {
+          os << ' ' << index;
+        }
+        os << "\n";
+      }
+      for (auto &[key, verdict] : entry.verdicts) {
+        os << "outline " << key.first << ' ' << key.second << " 0 "
+           << verdict.Key << ' ' << verdict.Reason << "\n";
+      }
+    }
+
+    if (Error E = temp->keep(path)) {
+      LLVM_DEBUG(dbgs() << "Could not write " << path << ": "
+                        << toString(std::move(E)) << "\n");
+      consumeError(std::move(E));
+    }
+  }
+}
@@ -0,0 +1,75 @@
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace llvm {
+
+/// Cached outcome of ProgramSlice::canOutline for one lazification candidate.
+/// Only rejections are cached: alias analyses such as GlobalsAA answer
+/// queries about calls from the bodies of their callees, which the caller's
+/// hash does not cover. A stale rejection only misses a lazification, while
+/// a stale approval could outline a slice that is no longer safe to defer.
+struct OutlineVerdict {
+  bool CanOutline;
+  std::string Key;
+  std::string Reason;
+};
+
+/// On-disk cache of the results of the Wyvern analyses, enabled with
+/// -wylazy-cache-dir. Results are keyed by the structural hash of the
+/// function they were computed for, so later builds and LTO links only
+/// recompute them for functions that changed. Each function has its own file
+/// in the cache directory, written to a temporary file first and renamed into
+/// place, so concurrent compilations sharing the cache never see partial
+/// entries. Results computed with other values of the options that change
+/// them are not reused. The cache is thread-safe.
+class AnalysisCache {
+public:
+  /// Returns the cache, or nullptr if -wylazy-cache-dir is not set.
+  static AnalysisCache *get();
+
+  /// Returns the promising arguments recorded for the function whose hash is
+  /// @param hash, if any.
+  Optional<SmallVector<int>> getPromisingArgs(StringRef hash);
+  void setPromisingArgs(StringRef hash, ArrayRef<int> promisingArgs);
+
+  /// Returns the verdict recorded for lazifying argument @param argIdx of the
+  /// call site numbered @param callSite in the function whose hash is
+  /// @param hash, if any.
+  Optional<OutlineVerdict> getOutlineVerdict(StringRef hash, unsigned callSite,
+                                             unsigned argIdx);
+  /// Records rejection @param verdict. Approvals are ignored.
+  void setOutlineVerdict(StringRef hash, unsigned callSite, unsigned argIdx,
+                         OutlineVerdict verdict);
+
+  /// Writes the entries changed since the last flush to disk.
+  void flush();
+
+private:
+  explicit AnalysisCache(StringRef dir);
+
+  struct Entry {
+    Optional<SmallVector<int>> promisingArgs;
+    std::map<std::pair<unsigned, unsigned>, OutlineVerdict> verdicts;
+    bool dirty = false;
+  };
+
+  /// Returns the entry of @param hash, reading it from disk the first time.
+  /// Must be called with _mutex held.
+  Entry &lookup(StringRef hash);
+
+  std::string getPath(StringRef hash) const;
+
+  std::string _dir;
+  std::string _header;
+  std::mutex _mutex;
+  StringMap<Entry> _entries;
+};
+} // namespace llvm
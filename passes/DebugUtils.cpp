@@ -1,11 +1,30 @@
+#include "DebugUtils.h"
+
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 
 #include <string>
 #include <vector>
 
 namespace llvm {
 
+static cl::opt<bool> WyvernTimeTrace(
+    "wylazy-time-trace", cl::init(false),
+    cl::desc("Wyvern - Record the stages of the Wyvern passes as events in "
+             "the -time-trace profile."));
+
+WyvernStageTimer::WyvernStageTimer(StringRef name, StringRef description,
+                                   StringRef detail) {
+  if (TimePassesIsEnabled) {
+    _timer.emplace(name, description, "wyvern", "Wyvern stages");
+  }
+  if (WyvernTimeTrace) {
+    _traceScope.emplace(description, detail);
+  }
+}
+
 void generatePrintf(std::string_view fmt,
                            const std::vector<llvm::Value *> &args,
                            llvm::IRBuilder<> &builder) {
@@ -1,5 +1,8 @@
+#include "llvm/ADT/Optional.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
 
 #include <string>
 #include <vector>
@@ -9,4 +12,19 @@ namespace llvm {
 void generatePrintf(std::string_view fmt,
                            const std::vector<Value *> &args,
                            IRBuilder<> &builder);
+
+/// Times a stage of the Wyvern passes while in scope. With -time-passes, the
+/// stage is reported in the Wyvern timer group. With -wylazy-time-trace, it is
+/// also recorded as an event of the -time-trace profile, with @param detail.
+/// Timers are not thread-safe, so stages that run in parallel are timed as a
+/// whole from the thread that launches them.
+class WyvernStageTimer {
+public:
+  WyvernStageTimer(StringRef name, StringRef description,
+                   StringRef detail = "");
+
+private:
+  Optional<NamedRegionTimer> _timer;
+  Optional<TimeTraceScope> _traceScope;
+};
 } // namespace llvm
\ No newline at end of file
@@ -1,21 +1,49 @@
-#define DEBUG_TYPE "FindLazyfiablePass"
-
 #include "FindLazyfiable.h"
-
+#include "AnalysisCache.h"
+#include "DebugUtils.h"
+#include "StructuralHash.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Transforms/IPO/FunctionAttrs.h"
 #include "llvm/Transforms/Utils/LCSSA.h"
 #include "llvm/Transforms/Utils/LoopSimplify.h"
 #include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 #include "llvm/Transforms/Utils/UnifyFunctionExitNodes.h"
 
 #include <map>
 
+#define DEBUG_TYPE "FindLazyfiablePass"
+
 using namespace llvm;
 
-void FindLazyfiableAnalysis::DFS(BasicBlock *first, BasicBlock *exit,
-                                 std::set<BasicBlock *> &visited, Value *arg,
-                                 int index) {
+STATISTIC(NumFunctionsCanonicalized,
+          "The number of functions canonicalized for lazification.");
+STATISTIC(NumFunctionsAlreadyCanonical,
+          "The number of candidate functions already in canonical form.");
+STATISTIC(NumFunctionsFromCache,
+          "The number of functions whose promising arguments were found in "
+          "the analysis cache.");
+
+static cl::opt<std::string> WyvernDumpFile(
+    "wylazy-dump-file", cl::init(""),
+    cl::desc("Wyvern - Path of a CSV file to dump the lazyfiable functions and "
+             "call sites found in the module into (none by default)."));
+
+static cl::opt<unsigned> WyvernThreads(
+    "wylazy-threads", cl::init(0),
+    cl::desc("Wyvern - Number of threads used to analyze functions "
+             "concurrently (0 uses all available hardware threads)."));
+
+bool LazyfiableInfo::DFS(BasicBlock *first, BasicBlock *exit,
+                         std::set<BasicBlock *> &visited, Value *arg) {
   std::stack<BasicBlock *> st;
   st.push(first);
   visited.insert(first);
@@ -42,10 +70,7 @@ void FindLazyfiableAnalysis::DFS(BasicBlock *first, BasicBlock *exit,
     }
 
     if (cur == exit) {
-      auto pair = std::make_pair(cur->getParent(), index);
-      _promisingFunctions.insert(cur->getParent());
-      _promisingFunctionArgs.insert(pair);
-      return;
+      return true;
     }
 
     for (auto it = succ_begin(cur), it_end = succ_end(cur); it != it_end;
@@ -57,9 +82,12 @@ void FindLazyfiableAnalysis::DFS(BasicBlock *first, BasicBlock *exit,
       }
     }
   }
+
+  return false;
 }
 
-void FindLazyfiableAnalysis::findLazyfiablePaths(Function &F) {
+SmallVector<int> LazyfiableInfo::findLazyfiablePaths(Function &F) {
+  SmallVector<int> promisingArgs;
   BasicBlock &entry = F.getEntryBlock();
   BasicBlock *exit = nullptr;
 
@@ -72,22 +100,27 @@ void FindLazyfiableAnalysis::findLazyfiablePaths(Function &F) {
   }
 
   if (exit == nullptr) {
-    return;
+    return promisingArgs;
   }
 
   unsigned int index = 0;
   for (auto &arg : F.args()) {
     std::set<BasicBlock *> visited;
     if (Value *vArg = dyn_cast<Value>(&arg)) {
-      DFS(&entry, exit, visited, vArg, index);
+      if (DFS(&entry, exit, visited, vArg)) {
+        promisingArgs.push_back(index);
+      }
     }
     ++index;
   }
+
+  return promisingArgs;
 }
 
-bool FindLazyfiableAnalysis::isArgumentComplex(Instruction &I) { return true; }
+bool LazyfiableInfo::isArgumentComplex(Instruction &) { return true; }
 
-void FindLazyfiableAnalysis::analyzeCall(CallInst *CI) {
+void LazyfiableInfo::analyzeCall(
+    CallInst *CI, SmallVectorImpl<std::pair<CallInst *, int>> &candidates) {
   Function *Callee = CI->getCalledFunction();
   if (Callee == nullptr || Callee->isDeclaration()) {
     return;
@@ -97,9 +130,7 @@ void FindLazyfiableAnalysis::analyzeCall(CallInst *CI) {
     if (Instruction *I = dyn_cast<Instruction>(&arg)) {
       unsigned int index = CI->getArgOperandNo(&arg);
       if (isArgumentComplex(*I)) {
-        auto pair = std::make_pair(Callee, index);
-        _lazyfiableCallSitesStats.insert(pair);
-        _lazyfiableCallSites.insert(std::make_pair(CI, index));
+        candidates.push_back(std::make_pair(CI, index));
       }
     }
   }
@@ -131,8 +162,8 @@ static FunctionCallee getDummyFunctionForType(Module &M, Type *Type) {
   return dummyFunction;
 }
 
-std::set<Function *> FindLazyfiableAnalysis::addMissingUses(Module &M,
-                                                            LLVMContext &Ctx) {
+std::set<Function *> LazyfiableInfo::addMissingUses(Module &M,
+                                                    LLVMContext &Ctx) {
   std::set<Function *> dummyFunctions;
   for (Function &F : M) {
     std::set<Value *> vArgs;
@@ -163,6 +194,106 @@ std::set<Function *> FindLazyfiableAnalysis::addMissingUses(Module &M,
   return dummyFunctions;
 }
 
+/// Returns the functions that take part in potential lazification: those that
+/// contain candidate call sites (direct calls to a defined, non-variadic
+/// function with at least one actual parameter computed by an instruction),
+/// plus the callees of these call sites. Only these need to be canonicalized.
+static SmallPtrSet<const Function *, 32>
+findCanonicalizationCandidates(Module &M) {
+  SmallPtrSet<const Function *, 32> candidates;
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+
+    for (auto I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+      CallInst *CI = dyn_cast<CallInst>(&*I);
+      if (!CI) {
+        continue;
+      }
+
+      Function *Callee = CI->getCalledFunction();
+      if (Callee == nullptr || Callee->isDeclaration() || Callee->isVarArg()) {
+        continue;
+      }
+
+      bool hasInstructionArg = false;
+      for (auto &arg : CI->args()) {
+        hasInstructionArg |= isa<Instruction>(&arg);
+      }
+      if (hasInstructionArg) {
+        candidates.insert(&F);
+        candidates.insert(Callee);
+      }
+    }
+  }
+  return candidates;
+}
+
+/// Returns whether @param F is already in the form produced by the
+/// canonicalization passes: no promotable allocas, a single return block, and
+/// all loops in simplified and LCSSA forms.
+static bool isInCanonicalForm(Function &F, FunctionAnalysisManager &FAM) {
+  for (Instruction &I : F.getEntryBlock()) {
+    if (AllocaInst *AI = dyn_cast<AllocaInst>(&I)) {
+      if (isAllocaPromotable(AI)) {
+        return false;
+      }
+    }
+  }
+
+  unsigned int numReturnBlocks = 0;
+  for (BasicBlock &BB : F) {
+    if (isa<ReturnInst>(BB.getTerminator())) {
+      ++numReturnBlocks;
+    }
+  }
+  if (numReturnBlocks > 1) {
+    return false;
+  }
+
+  DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    if (!L->isLoopSimplifyForm() || !L->isLCSSAForm(DT)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace {
+/// Runs the per-function canonicalization passes, but only over the functions
+/// that take part in lazification and that are not in canonical form yet.
+class CanonicalizeCandidatesPass
+    : public PassInfoMixin<CanonicalizeCandidatesPass> {
+public:
+  CanonicalizeCandidatesPass(SmallPtrSet<const Function *, 32> candidates)
+      : _candidates(std::move(candidates)) {
+    _FPM.addPass(PromotePass());
+    _FPM.addPass(LCSSAPass());
+    _FPM.addPass(LoopSimplifyPass());
+    _FPM.addPass(UnifyFunctionExitNodesPass());
+  }
+
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    if (!_candidates.count(&F)) {
+      return PreservedAnalyses::all();
+    }
+    if (isInCanonicalForm(F, FAM)) {
+      ++NumFunctionsAlreadyCanonical;
+      return PreservedAnalyses::all();
+    }
+    ++NumFunctionsCanonicalized;
+    return _FPM.run(F, FAM);
+  }
+
+private:
+  SmallPtrSet<const Function *, 32> _candidates;
+  FunctionPassManager _FPM;
+};
+} // namespace
+
 ///
 /// To find the most optimization opportunities, we require the IR to have been
 /// transformed by the following passes:
@@ -175,7 +306,29 @@ std::set<Function *> FindLazyfiableAnalysis::addMissingUses(Module &M,
 /// While it is easy enough to do so from `opt`, when running from `clang` we
 /// cannot manipulate when/which passes run, therefore, we run them here manually
 /// to guarantee that the IR is in the format we expect.
-void runRequiredPasses(Module &M) {
+///
+/// Under the new pass manager, this runs within the caller's analysis managers,
+/// so dominator trees, loop info, etc., are shared with the rest of the
+/// pipeline and invalidated as these passes change the IR.
+///
+/// The function passes only run over the functions that may take part in
+/// lazification, and skip those already in canonical form. Function attribute
+/// inference still runs over the whole call graph, since slices may call any
+/// function and we need to know which of them are read-only.
+void llvm::runRequiredPasses(Module &M, ModuleAnalysisManager &MAM) {
+  WyvernStageTimer timer("required-passes",
+                         "Canonicalize functions for lazification");
+  ModulePassManager MPM;
+
+  MPM.addPass(createModuleToFunctionPassAdaptor(
+      CanonicalizeCandidatesPass(findCanonicalizationCandidates(M))));
+  MPM.addPass(
+      createModuleToPostOrderCGSCCPassAdaptor(PostOrderFunctionAttrsPass()));
+
+  MPM.run(M, MAM);
+}
+
+void llvm::runRequiredPasses(Module &M) {
   LoopAnalysisManager LAM;
   FunctionAnalysisManager FAM;
   CGSCCAnalysisManager CGAM;
@@ -190,46 +343,184 @@ void runRequiredPasses(Module &M) {
 
   ModulePassManager MPM =
       PB.buildO0DefaultPipeline(llvm::OptimizationLevel::O0);
+  MPM.run(M, MAM);
 
-  MPM.addPass(createModuleToFunctionPassAdaptor(PromotePass()));
-  MPM.addPass(createModuleToFunctionPassAdaptor(LCSSAPass()));
-  MPM.addPass(createModuleToFunctionPassAdaptor(LoopSimplifyPass()));
-  MPM.addPass(
-      createModuleToPostOrderCGSCCPassAdaptor(PostOrderFunctionAttrsPass()));
-  MPM.addPass(createModuleToFunctionPassAdaptor(UnifyFunctionExitNodesPass()));
+  runRequiredPasses(M, MAM);
+}
 
-  MPM.run(M, MAM);
+void llvm::parallelForEachFunction(ArrayRef<Function *> functions,
+                                   function_ref<void(Function &)> fn) {
+  if (WyvernThreads == 1 || functions.size() < 2) {
+    for (Function *F : functions) {
+      fn(*F);
+    }
+    return;
+  }
+
+  ThreadPool pool(hardware_concurrency(WyvernThreads));
+  for (Function *F : functions) {
+    pool.async([&fn, F]() { fn(*F); });
+  }
+  pool.wait();
 }
 
-bool FindLazyfiableAnalysis::runOnModule(Module &M) {
-  runRequiredPasses(M);
+/// Returns the promising arguments of function @param F recorded in its
+/// metadata @param MD, or None if the metadata does not match the signature
+/// of @param F, which passes like argument promotion or dead argument
+/// elimination may have changed since the metadata was recorded.
+static Optional<SmallVector<int>> readPromisingArgs(Function &F, MDNode *MD) {
+  if (MD->getNumOperands() == 0) {
+    return None;
+  }
+  auto *numArgs = mdconst::dyn_extract_or_null<ConstantInt>(MD->getOperand(0));
+  if (!numArgs || numArgs->getZExtValue() != F.arg_size()) {
+    return None;
+  }
 
+  SmallVector<int> promisingArgs;
+  for (const MDOperand &op : drop_begin(MD->operands())) {
+    auto *arg = dyn_cast_or_null<MDTuple>(op.get());
+    if (!arg || arg->getNumOperands() != 2) {
+      return None;
+    }
+    auto *index = mdconst::dyn_extract_or_null<ConstantInt>(arg->getOperand(0));
+    auto *type = mdconst::dyn_extract_or_null<Constant>(arg->getOperand(1));
+    if (!index || !type || index->getZExtValue() >= F.arg_size() ||
+        F.getArg(index->getZExtValue())->getType() != type->getType()) {
+      return None;
+    }
+    promisingArgs.push_back(index->getZExtValue());
+  }
+  return promisingArgs;
+}
+
+void LazyfiableInfo::analyze(Module &M) {
   std::set<Function *> dummyFunctions = addMissingUses(M, M.getContext());
 
+  /// Per-function results, computed independently for each function and then
+  /// merged in module order, so the analysis' results do not depend on the
+  /// order in which threads finish.
+  struct FunctionResults {
+    SmallVector<int> promisingArgs;
+    SmallVector<std::pair<CallInst *, int>> callSites;
+  };
+
+  std::vector<Function *> functions;
   for (Function &F : M) {
     if (F.isDeclaration() || F.isVarArg()) {
       continue;
     }
+    functions.push_back(&F);
+  }
 
-    findLazyfiablePaths(F);
+  std::vector<FunctionResults> results(functions.size());
+  DenseMap<Function *, unsigned> resultIndex;
+  for (unsigned int i = 0; i < functions.size(); ++i) {
+    resultIndex[functions[i]] = i;
+  }
 
-    for (auto I = inst_begin(F), E = inst_end(F); I != E; ++I) {
-      if (CallInst *CI = dyn_cast<CallInst>(&*I)) {
-        analyzeCall(CI);
+  AnalysisCache *cache = AnalysisCache::get();
+  // Looking metadata up by name registers its kind in the context, which is
+  // not thread-safe, so the kind is resolved before the workers start.
+  unsigned promisingArgsKind =
+      M.getContext().getMDKindID(PromisingArgsMetadataName);
+  {
+    WyvernStageTimer timer("find-lazyfiable-paths", "Find lazyfiable paths");
+    parallelForEachFunction(functions, [&](Function &F) {
+      FunctionResults &res = results[resultIndex.lookup(&F)];
+      MDNode *MD = F.hasAvailableExternallyLinkage()
+                       ? F.getMetadata(promisingArgsKind)
+                       : nullptr;
+      // Metadata that does not match the function is ignored, and the
+      // function is analyzed as if it had none.
+      Optional<SmallVector<int>> imported;
+      if (MD) {
+        imported = readPromisingArgs(F, MD);
       }
+      if (imported) {
+        res.promisingArgs = std::move(*imported);
+      } else if (cache) {
+        std::string hash = computeFunctionHash(F);
+        if (auto cached = cache->getPromisingArgs(hash)) {
+          res.promisingArgs = std::move(*cached);
+          ++NumFunctionsFromCache;
+        } else {
+          res.promisingArgs = findLazyfiablePaths(F);
+          cache->setPromisingArgs(hash, res.promisingArgs);
+        }
+      } else {
+        res.promisingArgs = findLazyfiablePaths(F);
+      }
+
+      for (auto I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+        if (CallInst *CI = dyn_cast<CallInst>(&*I)) {
+          analyzeCall(CI, res.callSites);
+        }
+      }
+    });
+  }
+
+  for (unsigned int i = 0; i < functions.size(); ++i) {
+    for (int index : results[i].promisingArgs) {
+      _promisingFunctions.insert(functions[i]);
+      _promisingFunctionArgs.insert(std::make_pair(functions[i], index));
+    }
+    for (auto &[CI, index] : results[i].callSites) {
+      _lazyfiableCallSitesStats.insert(
+          std::make_pair(CI->getCalledFunction(), index));
+      _lazyfiableCallSites.insert(std::make_pair(CI, index));
     }
   }
 
   removeDummyFunctions(dummyFunctions);
 
-  dump_results();
+  if (cache) {
+    cache->flush();
+  }
 
-  return false;
+  if (!WyvernDumpFile.empty()) {
+    dump_results(WyvernDumpFile);
+  }
+}
+
+bool LazyfiableInfo::exportPromisingArgs(Module &M) {
+  bool changed = false;
+  std::map<Function *, SmallVector<Metadata *>> indices;
+  Type *i32 = Type::getInt32Ty(M.getContext());
+  for (auto &[F, index] : _promisingFunctionArgs) {
+    SmallVector<Metadata *> &operands = indices[F];
+    if (operands.empty()) {
+      operands.push_back(
+          ConstantAsMetadata::get(ConstantInt::get(i32, F->arg_size())));
+    }
+    Metadata *arg[] = {
+        ConstantAsMetadata::get(ConstantInt::get(i32, index)),
+        ConstantAsMetadata::get(UndefValue::get(F->getArg(index)->getType()))};
+    operands.push_back(MDNode::get(M.getContext(), arg));
+  }
+  for (Function &F : M) {
+    if (F.isDeclaration() || F.hasAvailableExternallyLinkage()) {
+      continue;
+    }
+    auto it = indices.find(&F);
+    MDNode *MD = it == indices.end()
+                     ? nullptr
+                     : MDNode::get(M.getContext(), it->second);
+    if (F.getMetadata(PromisingArgsMetadataName) != MD) {
+      F.setMetadata(PromisingArgsMetadataName, MD);
+      changed = true;
+    }
+  }
+  return changed;
 }
 
-void FindLazyfiableAnalysis::dump_results() {
+void LazyfiableInfo::dump_results(StringRef path) {
   std::error_code ec;
-  raw_fd_ostream outfile("lazyfiable.csv", ec);
+  raw_fd_ostream outfile(path, ec);
+  if (ec) {
+    errs() << "Failed to open " << path << ": " << ec.message() << "\n";
+    return;
+  }
 
   outfile << "function,lazyArg\n";
   for (auto &entry : _promisingFunctionArgs) {
@@ -251,9 +542,24 @@ void FindLazyfiableAnalysis::dump_results() {
   }
 }
 
-void FindLazyfiableAnalysis::getAnalysisUsage(AnalysisUsage &AU) const {}
+AnalysisKey FindLazyfiableAnalysis::Key;
+
+LazyfiableInfo FindLazyfiableAnalysis::run(Module &M,
+                                           ModuleAnalysisManager &) {
+  LazyfiableInfo info;
+  info.analyze(M);
+  return info;
+}
+
+bool FindLazyfiableWrapperPass::runOnModule(Module &M) {
+  runRequiredPasses(M);
+  _info.analyze(M);
+  return false;
+}
+
+void FindLazyfiableWrapperPass::getAnalysisUsage(AnalysisUsage &) const {}
 
-char FindLazyfiableAnalysis::ID = 0;
-static RegisterPass<FindLazyfiableAnalysis>
+char FindLazyfiableWrapperPass::ID = 0;
+static RegisterPass<FindLazyfiableWrapperPass>
     X("find-lazyfiable", "Wyvern - Find Lazyfiable function arguments.", false,
       false);
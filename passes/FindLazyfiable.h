@@ -18,22 +18,56 @@
 #include <stack>
 #include <utility>
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
 
 namespace llvm {
-struct FindLazyfiableAnalysis : public ModulePass {
-public:
-  static char ID;
-  FindLazyfiableAnalysis() : ModulePass(ID) {}
 
-  bool runOnModule(Module &);
-  void getAnalysisUsage(AnalysisUsage &) const;
+/// Brings module @param M into the canonical form expected by the analysis
+/// (see the definition for the list of passes), reusing the analyses cached in
+/// @param MAM and invalidating them as the IR changes.
+void runRequiredPasses(Module &M, ModuleAnalysisManager &MAM);
+
+/// Same as above, but for clients (i.e., the legacy pass manager) that do not
+/// have a new pass manager analysis pipeline at hand.
+void runRequiredPasses(Module &M);
+
+/// Runs @param fn over each function in @param functions, spreading the work
+/// over a thread pool whose size is controlled by -wylazy-threads. @param fn
+/// must not modify the IR, nor any state shared between functions.
+void parallelForEachFunction(ArrayRef<Function *> functions,
+                             function_ref<void(Function &)> fn);
+
+/// Name of the function metadata that records the promising arguments of a
+/// function: the number of arguments of the function, followed by a tuple
+/// with the index and an undef of the type of each promising argument, so
+/// metadata left stale by changes to the signature is detected.
+constexpr const char *PromisingArgsMetadataName = "wyvern.promising";
+
+/// Results of the lazifiable analysis over a module. Shared by the legacy and
+/// the new pass manager versions of the analysis.
+class LazyfiableInfo {
+public:
+  /// Runs the analysis over module @param M, which is expected to already be
+  /// in canonical form (see runRequiredPasses). Functions imported by ThinLTO
+  /// (available_externally) that carry promising arguments metadata are not
+  /// analyzed; the metadata computed in their own module is used instead.
+  void analyze(Module &M);
+
+  /// Records the promising arguments of each function in module @param M as
+  /// metadata on the function. ThinLTO imports the metadata along with the
+  /// function's body, so backends can lazify call sites to callees defined in
+  /// other modules. Returns whether any metadata changed.
+  bool exportPromisingArgs(Module &M);
 
   /// Returns the set of promising functions, regardless of which formal
   /// paremeter happens to be lazifiable. Used for instrumentation.
@@ -82,19 +116,22 @@ private:
    * to find paths from entry BB @param first to exit BB @param exit
    * which do not go through any use of argument @param arg.
    *
-   * If any such path is found, record them in the analysis' results
-   * and statistics.
+   * Returns whether any such path was found.
    *
    */
-  void DFS(BasicBlock *, BasicBlock *, std::set<BasicBlock *> &, Value *, int);
+  bool DFS(BasicBlock *, BasicBlock *, std::set<BasicBlock *> &, Value *);
 
   /**
    * Searches for lazyfiable paths in function @param F, by
    * checking whether there are paths in its CFG which do not
-   * use each of its input arguments.
+   * use each of its input arguments. Returns the indices of the
+   * arguments for which such a path exists.
+   *
+   * Does not modify the analysis' results, so it may run concurrently
+   * over different functions.
    *
    */
-  void findLazyfiablePaths(Function &);
+  SmallVector<int> findLazyfiablePaths(Function &);
 
   /**
    * Placeholder.
@@ -107,16 +144,48 @@ private:
   /**
    * Analyzes a given function callsite @param CI, to evaluate whether
    * any of its arguments can/should be encapsulated into a lazyfied
-   * lambda/sliced function.
+   * lambda/sliced function. The (callsite, argument) candidates found
+   * are appended to @param candidates.
+   *
+   * Does not modify the analysis' results, so it may run concurrently
+   * over different functions.
    *
    */
-  void analyzeCall(CallInst *);
+  void analyzeCall(CallInst *, SmallVectorImpl<std::pair<CallInst *, int>> &);
 
   /**
    * Dumps statistics for number of lazyfiable call sites and
-   * lazyfiable function paths found within the module.
+   * lazyfiable function paths found within the module into
+   * the CSV file at path.
    *
    */
-  void dump_results();
+  void dump_results(StringRef path);
+};
+
+/// New pass manager version of the analysis. The IR must have been
+/// canonicalized with runRequiredPasses before the result is requested.
+struct FindLazyfiableAnalysis
+    : public AnalysisInfoMixin<FindLazyfiableAnalysis> {
+  using Result = LazyfiableInfo;
+  Result run(Module &M, ModuleAnalysisManager &MAM);
+
+private:
+  friend AnalysisInfoMixin<FindLazyfiableAnalysis>;
+  static AnalysisKey Key;
+};
+
+/// Legacy pass manager version of the analysis. Canonicalizes the module
+/// before analyzing it.
+struct FindLazyfiableWrapperPass : public ModulePass {
+  static char ID;
+  FindLazyfiableWrapperPass() : ModulePass(ID) {}
+
+  bool runOnModule(Module &);
+  void getAnalysisUsage(AnalysisUsage &) const;
+
+  LazyfiableInfo &getLazyfiableInfo() { return _info; }
+
+private:
+  LazyfiableInfo _info;
 };
 } // namespace llvm
@@ -201,7 +201,7 @@ void WyvernInstrumentationPass::InstrumentEntryPoint(Module &M) {
   updateDebugInfo(initProfCall, F);
 }
 
-bool WyvernInstrumentationPass::runOnModule(Module &M) {
+bool WyvernInstrumentationPass::instrument(Module &M, LazyfiableInfo &FLA) {
   if (!WyvernPreInstrument) {
     return false;
   }
@@ -227,8 +227,6 @@ bool WyvernInstrumentationPass::runOnModule(Module &M) {
   initProfFun =
       M.getOrInsertFunction("_wyinstr_init_prof", Type::getVoidTy(Ctx));
 
-  FindLazyfiableAnalysis &FLA = getAnalysis<FindLazyfiableAnalysis>();
-
   std::shared_ptr<std::set<Function *>> promisingFunctions = nullptr;
   if (!WyvernInstrumentAll) {
     promisingFunctions =
@@ -253,8 +251,30 @@ bool WyvernInstrumentationPass::runOnModule(Module &M) {
   return true;
 }
 
+bool WyvernInstrumentationPass::runOnModule(Module &M) {
+  LazyfiableInfo &FLA =
+      getAnalysis<FindLazyfiableWrapperPass>().getLazyfiableInfo();
+  return instrument(M, FLA);
+}
+
+PreservedAnalyses InstrumentationPass::run(Module &M,
+                                           ModuleAnalysisManager &MAM) {
+  if (!WyvernPreInstrument) {
+    return PreservedAnalyses::all();
+  }
+
+  runRequiredPasses(M, MAM);
+
+  LazyfiableInfo &FLA = MAM.getResult<FindLazyfiableAnalysis>(M);
+  WyvernInstrumentationPass instrumenter;
+  if (!instrumenter.instrument(M, FLA)) {
+    return PreservedAnalyses::all();
+  }
+  return PreservedAnalyses::none();
+}
+
 void WyvernInstrumentationPass::getAnalysisUsage(AnalysisUsage &AU) const {
-  AU.addRequired<FindLazyfiableAnalysis>();
+  AU.addRequired<FindLazyfiableWrapperPass>();
   AU.addRequired<TargetLibraryInfoWrapperPass>();
 }
 
@@ -3,12 +3,15 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
 namespace llvm {
+class LazyfiableInfo;
+
 struct WyvernInstrumentationPass : public ModulePass {
   static char ID;
   WyvernInstrumentationPass() : ModulePass(ID) {}
@@ -69,7 +72,17 @@ struct WyvernInstrumentationPass : public ModulePass {
   /// bitmap of evaluated arguments. Returns the AllocaInst that contains the
   /// memory address of the bitmap.
   AllocaInst *InstrumentEntry(Function *F);
+
+  /// Instruments module @param M, using the promising functions found by the
+  /// lazifiable analysis in @param FLI. Returns whether the module was changed.
+  bool instrument(Module &M, LazyfiableInfo &FLI);
+
   void getAnalysisUsage(AnalysisUsage &AU) const;
   bool runOnModule(Module &);
 };
+
+/// New pass manager version of the instrumentation pass.
+struct InstrumentationPass : public PassInfoMixin<InstrumentationPass> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
 } // namespace llvm
@@ -1,26 +1,36 @@
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/BasicAliasAnalysis.h"
+#include "llvm/Analysis/CFG.h"
 #include "llvm/Analysis/CFLSteensAliasAnalysis.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/Analysis/GlobalsModRef.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/FormatVariadic.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 
+#include "AnalysisCache.h"
 #include "DebugUtils.h"
 #include "FindLazyfiable.h"
-#include "Lazyfication.h"
 #include "ProgramSlice.h"
+#include "Lazyfication.h"
+#include "StructuralHash.h"
 
+#include <cmath>
 #include <fstream>
-#include <random>
 
 #define DEBUG_TYPE "WyvernLazyficationPass"
 
@@ -34,15 +44,61 @@ STATISTIC(SmallestSliceSize,
           "Size of smallest slice generated for lazification.");
 STATISTIC(TotalSliceSize,
           "Cumulative size of all slices generated for lazification.");
+STATISTIC(NumCallsitesSkippedFunctionSize,
+          "The number of candidate callsites skipped because their caller "
+          "exceeds the instruction budget.");
+STATISTIC(NumCallsitesSkippedCandidateLimit,
+          "The number of candidate callsites skipped because their caller "
+          "exceeds the candidate budget.");
+STATISTIC(NumCallsitesSkippedTimeBudget,
+          "The number of candidate callsites skipped because the module "
+          "exceeded the compile-time budget.");
+STATISTIC(NumDelegateCallsInlined,
+          "The number of delegate calls inlined into callee clones.");
+STATISTIC(NumCalleesUnified,
+          "The number of callees replaced by their clone at every call site.");
+STATISTIC(NumCallsitesPreForced,
+          "The number of call sites passing a pre-forced thunk to a unified "
+          "callee.");
+STATISTIC(NumCalleesRemoved,
+          "The number of internal callees removed because all of their call "
+          "sites were lazified.");
+STATISTIC(NumScalarThunks,
+          "The number of lazified call sites that pass their environment to "
+          "the callee clone in registers instead of a thunk.");
+STATISTIC(NumCallsitesNotMemoized,
+          "The number of lazified call sites given non-memoized thunks because "
+          "their argument is forced at most once.");
+STATISTIC(NumCallsitesInLoops,
+          "The number of lazified call sites in loops whose thunk is reused "
+          "across iterations.");
+STATISTIC(NumPartialSlices,
+          "The number of lazified call sites whose slice is only outlined in "
+          "part, computing the instructions that cannot be outlined eagerly.");
+STATISTIC(NumForcesPlaced,
+          "The number of points where callee clones force their thunk.");
+STATISTIC(NumForcesHoisted,
+          "The number of thunk forces hoisted out of loops in callee clones.");
+STATISTIC(NumOutlineVerdictsFromCache,
+          "The number of slice outlining verdicts found in the analysis "
+          "cache.");
 
 using namespace llvm;
 
+/// Pass name of the optimization remarks emitted for lazification decisions.
+static const char *const RemarkPassName = "wyvern-lazify";
+
 static cl::opt<bool> WyvernLazyficationMemoization(
     "wylazy-memo", cl::init(true),
     cl::desc(
         "Wyvern - Enable memoization in Lazyfication (implement call-by-need"
         "rather than call-by-name)."));
 
+static cl::opt<bool> WyvernAdaptiveMemoization(
+    "wylazy-adaptive-memo", cl::init(true),
+    cl::desc("Wyvern - With memoization, use non-memoized thunks for "
+             "arguments that are forced at most once per call."));
+
 static cl::opt<bool> WyvernEnablePGO(
     "wylazy-pgo", cl::init(false),
     cl::desc("Wyvern - Enable Profile-Guided Optimization. Requires an "
@@ -63,12 +119,79 @@ static cl::opt<bool> WyvernLazyfication(
     cl::desc("Wyvern - Controls whether to enable lazyfication at all (used "
              "for comparison against O3 baseline)"));
 
+static cl::opt<unsigned> WyvernMaxFunctionInsts(
+    "wylazy-max-function-insts", cl::init(20000),
+    cl::desc("Wyvern - Maximum number of instructions in a function for its "
+             "call sites to be analyzed for lazification (0 = unlimited)."));
+
+static cl::opt<unsigned> WyvernMaxCandidatesPerFunction(
+    "wylazy-max-candidates", cl::init(256),
+    cl::desc("Wyvern - Maximum number of candidate call site arguments "
+             "analyzed for lazification per function (0 = unlimited)."));
+
+static cl::opt<double> WyvernTimeBudget(
+    "wylazy-time-budget", cl::init(0),
+    cl::desc("Wyvern - Wall-clock time, in seconds, after which no more call "
+             "sites of a module are analyzed for lazification (0 = "
+             "unlimited)."));
+
+static cl::opt<unsigned> WyvernInlineDelegateSize(
+    "wylazy-inline-delegate-size", cl::init(32),
+    cl::desc("Wyvern - Maximum number of instructions of a delegate function "
+             "for it to be inlined into callee clones (0 = never inline)."));
+
+static cl::opt<unsigned> WyvernScalarEnvSize(
+    "wylazy-scalar-env-size", cl::init(2),
+    cl::desc("Wyvern - Maximum number of environment values passed to callee "
+             "clones as parameters instead of a thunk, for arguments lazified "
+             "at a single call site (0 = always use thunks)."));
+
+static cl::opt<bool> WyvernUnifyCallees(
+    "wylazy-unify-callees", cl::init(false),
+    cl::desc("Wyvern - Replace internal callees by their shared clone, passing "
+             "pre-forced thunks at the call sites that were not lazified, "
+             "instead of keeping both copies of the callee."));
+
+static cl::opt<bool> WyvernInternalize(
+    "wylazy-internalize", cl::init(false),
+    cl::desc("Wyvern - Give generated functions internal linkage instead of "
+             "folding identical copies across modules. Implied when lazifying "
+             "the whole program at link time."));
+
 static cl::opt<bool> WyvernThunkDebugging(
     "wylazy-debug", cl::init(false),
     cl::desc("Wyvern - Controls whether to generate debugging code for thunks. "
              "This will print data on thunk data structures when they're "
              "initialized and evaluated."));
 
+/// Emits a remark explaining why argument @param index of call @param CI is not
+/// lazified, identified by @param key and described by @param reason. The
+/// value responsible for it, the size of the argument's slice and the
+/// argument's profile evaluation rate are included when known.
+static void emitMissedRemark(OptimizationRemarkEmitter &ORE, CallInst &CI,
+                             unsigned index, StringRef key, StringRef reason,
+                             const Value *culprit = nullptr,
+                             Optional<unsigned> sliceSize = None,
+                             Optional<double> evalRate = None) {
+  ORE.emit([&]() {
+    OptimizationRemarkMissed remark(RemarkPassName, key, &CI);
+    remark << "argument " << ore::NV("ArgNo", index) << " of call to "
+           << ore::NV("Callee", CI.getCalledOperand()->getName())
+           << " not lazified: " << ore::NV("Reason", reason);
+    if (culprit) {
+      remark << " (" << ore::NV("Culprit", culprit) << ")";
+    }
+    if (sliceSize) {
+      remark << "; slice size " << ore::NV("SliceSize", *sliceSize);
+    }
+    if (evalRate) {
+      remark << "; profile evaluation rate "
+             << ore::NV("ProfileRate", formatv("{0:F3}", *evalRate).str());
+    }
+    return remark;
+  });
+}
+
 /// Returns number of instructions in Function @param F. Is used to compute the
 /// size of delegate functions generated through slicing.
 static unsigned int getNumberOfInsts(Function &F) {
@@ -105,6 +228,130 @@ static void removeAttributesFromThunkArgument(Value &V, unsigned int index) {
   }
 }
 
+/// Where the uses of a lazified parameter in a callee clone are forced.
+struct ForcePlacement {
+  /// Instructions before which a force is inserted, dominators first.
+  SmallVector<Instruction *> Points;
+  /// Index in Points of the force that provides the value of each use.
+  std::map<Use *, unsigned> Covering;
+  /// Number of times a point was hoisted out of a loop.
+  unsigned NumHoisted = 0;
+};
+
+/// Returns the instruction before which use @param U must be forced: the use
+/// itself or, for PHINodes, the end of the incoming block.
+static Instruction *getForcingPoint(Use &U) {
+  Instruction *UserI = cast<Instruction>(U.getUser());
+  if (PHINode *PN = dyn_cast<PHINode>(UserI)) {
+    return PN->getIncomingBlock(U)->getTerminator();
+  }
+  return UserI;
+}
+
+/// Places the forces of the lazified value whose uses in function @param F
+/// are @param uses, so each use takes its value from a single dominating
+/// force instead of forcing the thunk itself. Points executed on every
+/// iteration of a loop that exits are hoisted to its preheader, and, if the
+/// uses are anticipated at their nearest common dominator, that is, one of
+/// them post-dominates it, a force there serves them all. Forces dominated by
+/// another one are not inserted. Forces are never moved to paths that do not
+/// use the value, so the thunk stays lazy.
+static ForcePlacement placeForces(Function &F, ArrayRef<Use *> uses) {
+  DominatorTree DT(F);
+  PostDominatorTree PDT(F);
+  LoopInfo LI(DT);
+
+  ForcePlacement placement;
+  SmallVector<Instruction *> candidates;
+  for (Use *U : uses) {
+    Instruction *point = getForcingPoint(*U);
+    while (Loop *L = LI.getLoopFor(point->getParent())) {
+      BasicBlock *preheader = L->getLoopPreheader();
+      SmallVector<BasicBlock *> exitingBlocks;
+      L->getExitingBlocks(exitingBlocks);
+      // Loops without exits may never reach the point, so their forces are
+      // never hoisted.
+      if (!preheader || exitingBlocks.empty() ||
+          !all_of(exitingBlocks, [&](BasicBlock *exiting) {
+            return DT.dominates(point->getParent(), exiting);
+          })) {
+        break;
+      }
+      point = preheader->getTerminator();
+      ++placement.NumHoisted;
+    }
+    candidates.push_back(point);
+  }
+
+  BasicBlock *commonDom = nullptr;
+  for (Instruction *point : candidates) {
+    if (!DT.isReachableFromEntry(point->getParent())) {
+      continue;
+    }
+    commonDom = commonDom ? DT.findNearestCommonDominator(commonDom,
+                                                          point->getParent())
+                          : point->getParent();
+  }
+  if (commonDom && any_of(candidates, [&](Instruction *point) {
+        return PDT.dominates(point->getParent(), commonDom);
+      })) {
+    Instruction *commonPoint = commonDom->getTerminator();
+    for (Instruction *point : candidates) {
+      if (point->getParent() == commonDom && point->comesBefore(commonPoint)) {
+        commonPoint = point;
+      }
+    }
+    candidates.push_back(commonPoint);
+  }
+
+  // Visit dominators first, so forces dominated by another are skipped.
+  // Unreachable points come last, as they are dominated by any force.
+  DT.updateDFSNumbers();
+  auto getOrder = [&DT](Instruction *I) {
+    DomTreeNode *node = DT.getNode(I->getParent());
+    return node ? node->getDFSNumIn() : std::numeric_limits<unsigned>::max();
+  };
+  llvm::sort(candidates, [&](Instruction *A, Instruction *B) {
+    if (A->getParent() != B->getParent()) {
+      return getOrder(A) < getOrder(B);
+    }
+    return A->comesBefore(B);
+  });
+  auto forcesBefore = [&DT](Instruction *point, Instruction *I) {
+    return point == I || DT.dominates(point, I);
+  };
+
+  for (Instruction *point : candidates) {
+    if (none_of(placement.Points, [&](Instruction *placed) {
+          return forcesBefore(placed, point);
+        })) {
+      placement.Points.push_back(point);
+    }
+  }
+  for (Use *U : uses) {
+    Instruction *point = getForcingPoint(*U);
+    for (unsigned i = 0; i < placement.Points.size(); ++i) {
+      if (forcesBefore(placement.Points[i], point)) {
+        placement.Covering[U] = i;
+        break;
+      }
+    }
+    assert(placement.Covering.count(U) && "Use of thunk is not forced!");
+  }
+  return placement;
+}
+
+/// Gives call @param thunkCall, which forces a thunk, a debug location in the
+/// scope of its function if it has debug information and the call has none.
+/// Otherwise, inlining the delegate would leave the slice with locations in
+/// the caller's scope, which the verifier rejects.
+static void setThunkCallDebugLoc(CallInst &thunkCall) {
+  DISubprogram *SP = thunkCall.getFunction()->getSubprogram();
+  if (SP && !thunkCall.getDebugLoc()) {
+    thunkCall.setDebugLoc(DILocation::get(SP->getContext(), 0, 0, SP));
+  }
+}
+
 /// At this point, Function @param F was subject to transformations to lazify
 /// a function call, as either the caller or the callee.
 ///
@@ -116,101 +363,137 @@ static void removeAttributesFromThunkArgument(Value &V, unsigned int index) {
 ///
 /// In regards to the callee, it was lazyfied and one of its arguments is now
 /// @param thunkValue. However, uses of the argument within the function still
-/// use it as a value rather than a thunk, so we replace these uses by proper
-/// loading/invocation of the thunk.
+/// use it as a value rather than a thunk, so we replace these uses by calls
+/// to the delegate that evaluate the thunk, placed by placeForces.
+///
+/// The delegate called is @param slicedFunction or, if it is null, the one
+/// stored in the header of the thunk, of type @param thunkHeaderType.
 static void updateThunkArgUses(Function *F, Value *thunkValue,
-                               StructType *thunkStructType,
+                               StructType *thunkHeaderType,
                                Function *slicedFunction,
                                Value *valueToReplace = nullptr) {
   // We could be adding thunk uses in either the caller or callee
   bool isCallee = (valueToReplace == nullptr);
-  std::map<Use *, CallInst *> useCalls;
-
-  IRBuilder<> builder(F->getContext());
 
   Value *toReplace = isCallee ? thunkValue : valueToReplace;
+  SmallVector<Use *> uses;
   for (auto &Use : toReplace->uses()) {
-    Instruction *UserI = dyn_cast<Instruction>(Use.getUser());
-    if (UserI) {
-      // If the use is a PHINode, the use happens at the edge, so we cannot
-      // insert the thunk load/call at the PHI's block. Instead, we must insert
-      // them at the end of the block which flows into the PHI node
-      BasicBlock *origin = nullptr;
-      if (PHINode *PN = dyn_cast<PHINode>(UserI)) {
-        origin = PN->getIncomingBlock(Use);
-        builder.SetInsertPoint(origin->getTerminator());
-      } else {
-        builder.SetInsertPoint(UserI);
-      }
+    if (isa<Instruction>(Use.getUser())) {
+      uses.push_back(&Use);
+    }
+  }
 
-      Value *thunkCallTarget = slicedFunction;
-      // When optimizing the callee, load the function pointer from the thunk
-      if (isCallee) {
-        Value *thunkFPtrGEP = builder.CreateStructGEP(
-            thunkStructType, thunkValue, 0, "_wyvern_thunk_fptr_addr");
-        Value *thunkFPtrLoad =
-            builder.CreateLoad(thunkStructType->getStructElementType(0),
-                               thunkFPtrGEP, "_wyvern_thunkfptr");
-        thunkCallTarget = thunkFPtrLoad;
-      }
+  // Callee clones force the thunk once where possible. Callers force it at
+  // each use, which may not be dominated by the thunk's initialization
+  // otherwise.
+  ForcePlacement placement;
+  if (isCallee) {
+    placement = placeForces(*F, uses);
+    NumForcesPlaced += placement.Points.size();
+    NumForcesHoisted += placement.NumHoisted;
+  } else {
+    for (Use *U : uses) {
+      placement.Covering[U] = placement.Points.size();
+      placement.Points.push_back(getForcingPoint(*U));
+    }
+  }
 
-      // For both caller and callee, add call to delegate function (either
-      // loaded from the thunk or directly from the value used to initialize it)
-      if (WyvernThunkDebugging) {
-        std::string dbg_fmt;
-        std::vector<Value *> debug_args;
-        raw_string_ostream rso(dbg_fmt);
-
-        rso << "== Wyvern Debugging ==\nCalling thunk!\n";
-        rso << "\tInvoking function: " << F->getName() << "\n";
-        rso << "======================\n";
-        generatePrintf(dbg_fmt, debug_args, builder);
-      }
+  IRBuilder<> builder(F->getContext());
+  SmallVector<CallInst *> thunkCalls;
+  for (Instruction *point : placement.Points) {
+    builder.SetInsertPoint(point);
+
+    // Callers, and callee clones specialized for one delegate, call it
+    // directly. Shared callee clones call the delegate stored in the thunk.
+    FunctionCallee thunkCallTarget = slicedFunction;
+    if (!slicedFunction) {
+      Value *thunkFPtrGEP = builder.CreateStructGEP(
+          thunkHeaderType, thunkValue, 0, "_wyvern_thunk_fptr_addr");
+      Type *thunkFPtrType = thunkHeaderType->getStructElementType(0);
+      thunkCallTarget = FunctionCallee(
+          cast<FunctionType>(thunkFPtrType->getPointerElementType()),
+          builder.CreateLoad(thunkFPtrType, thunkFPtrGEP, "_wyvern_thunkfptr"));
+    }
 
-      CallInst *thunkCall =
-          builder.CreateCall(slicedFunction->getFunctionType(), thunkCallTarget,
-                             {thunkValue}, "_wyvern_thunkcall");
+    if (WyvernThunkDebugging) {
+      std::string dbg_fmt;
+      std::vector<Value *> debug_args;
+      raw_string_ostream rso(dbg_fmt);
 
-      // Replacing uses/users immediately can break use-def chains. Instead,
-      // keep track of all uses to be updated.
-      useCalls[&Use] = thunkCall;
+      rso << "== Wyvern Debugging ==\nCalling thunk!\n";
+      rso << "\tInvoking function: " << F->getName() << "\n";
+      rso << "======================\n";
+      generatePrintf(dbg_fmt, debug_args, builder);
     }
+
+    CallInst *thunkCall =
+        builder.CreateCall(thunkCallTarget, {thunkValue}, "_wyvern_thunkcall");
+    // Delegates are always fastcc, so calls through thunks can use it too.
+    thunkCall->setCallingConv(CallingConv::Fast);
+    setThunkCallDebugLoc(*thunkCall);
+    thunkCalls.push_back(thunkCall);
   }
 
-  // Update uses
-  for (auto &entry : useCalls) {
-    Use *use = entry.first;
-    CallInst *CI = entry.second;
-    use->set(CI);
+  // Replacing uses/users while placing the calls could break use-def chains,
+  // so uses are only updated once all calls are in place.
+  for (auto &[use, pointIdx] : placement.Covering) {
+    use->set(thunkCalls[pointIdx]);
+  }
+}
+
+/// Drops the memory attributes callee clone @param F, or a call redirected to
+/// it, inherited from the callee. The clone evaluates the slice, which may
+/// read any memory, and memoized delegates write their value back to the
+/// thunk.
+template <typename T> static void dropMemoryAttrs(T &F) {
+  for (Attribute::AttrKind kind :
+       {Attribute::ReadNone, Attribute::ReadOnly, Attribute::WriteOnly,
+        Attribute::ArgMemOnly, Attribute::InaccessibleMemOnly,
+        Attribute::InaccessibleMemOrArgMemOnly}) {
+    F.removeFnAttr(kind);
+  }
+}
+
+/// Inlines the calls of callee clone @param Clone to delegate
+/// @param slicedFunction, if it is small, so the optimizer can fuse the slice
+/// with the code that uses its value.
+static void inlineDelegateCalls(Function &Clone, Function &slicedFunction) {
+  if (getNumberOfInsts(slicedFunction) > WyvernInlineDelegateSize) {
+    return;
+  }
+  SmallVector<CallInst *> thunkCalls;
+  for (User *U : slicedFunction.users()) {
+    CallInst *thunkCall = dyn_cast<CallInst>(U);
+    if (thunkCall && thunkCall->getFunction() == &Clone) {
+      thunkCalls.push_back(thunkCall);
+    }
+  }
+  for (CallInst *thunkCall : thunkCalls) {
+    InlineFunctionInfo IFI;
+    if (InlineFunction(*thunkCall, IFI).isSuccess()) {
+      ++NumDelegateCallsInlined;
+    }
   }
 }
 
 /// Clones function @param Callee, replacing its formal parameter of index
-/// @param index with thunk @param thunkArg.
+/// @param index with thunk @param thunkArg. If @param slicedFunction is given,
+/// the clone is specialized for thunks of that delegate. Otherwise, it calls
+/// the delegate stored in each thunk, so it can be shared by all call sites.
 static Function *cloneCalleeFunction(Function &Callee, int index,
-                                     Function &slicedFunction, Value *thunkArg,
-                                     StructType *thunkStructType, Module &M) {
+                                     Function *slicedFunction, Value *thunkArg,
+                                     StructType *thunkHeaderType, Module &M) {
+  WyvernStageTimer timer("clone-callee", "Clone callee functions",
+                         Callee.getName());
   SmallVector<Type *> argTypes;
   for (auto &arg : Callee.args()) {
     argTypes.push_back(arg.getType());
   }
   argTypes[index] = thunkArg->getType();
 
-  // generate a random number to use as suffix for clone, to avoid naming
-  // conflicts
-  // NOTE: we cannot use a simple counter that gets incremented on every
-  // clone here, because when optimizing per translation unit, the same callee
-  // may be cloned across different translation units
-  std::random_device rd;
-  std::mt19937 mt(rd());
-  std::uniform_int_distribution<int64_t> dist(1, 1000000000);
-  uint64_t random_num = dist(mt);
   FunctionType *FT = FunctionType::get(Callee.getReturnType(), argTypes, false);
-  std::string functionName = "_wyvern_calleeclone_" + Callee.getName().str() +
-                             "_" + std::to_string(index) +
-                             std::to_string(random_num);
-  Function *newCallee =
-      Function::Create(FT, Function::ExternalLinkage, functionName, M);
+  Function *newCallee = Function::Create(FT, Function::InternalLinkage,
+                                         "_wyvern_calleeclone", M);
 
   ValueToValueMapTy vMap;
   int idx = -1;
@@ -227,37 +510,192 @@ static Function *cloneCalleeFunction(Function &Callee, int index,
   SmallVector<ReturnInst *, 4> Returns;
   CloneFunctionInto(newCallee, &Callee, vMap,
                     CloneFunctionChangeType::LocalChangesOnly, Returns);
-  updateThunkArgUses(newCallee, newCallee->getArg(index), thunkStructType,
-                     &slicedFunction);
+  // The clone takes a thunk instead of the lazified argument, so the
+  // callee's promising arguments do not describe it.
+  newCallee->setMetadata(PromisingArgsMetadataName, nullptr);
+  dropMemoryAttrs(*newCallee);
+  // Clones are only called directly from lazified call sites, so they may use
+  // the fast calling convention unless the callee needs a specific one.
+  if (newCallee->getCallingConv() == CallingConv::C) {
+    newCallee->setCallingConv(CallingConv::Fast);
+  }
+  updateThunkArgUses(newCallee, newCallee->getArg(index), thunkHeaderType,
+                     slicedFunction);
+
+  if (slicedFunction) {
+    inlineDelegateCalls(*newCallee, *slicedFunction);
+  }
   verifyFunction(*newCallee);
 
-  return newCallee;
+  // Name the clone after its contents rather than the translation unit it is
+  // emitted in, so identical clones from different modules can be folded.
+  return nameByStructuralHash(newCallee, "_wyvern_calleeclone_" +
+                                             Callee.getName().str() + "_" +
+                                             std::to_string(index) + "_");
 }
 
-bool WyvernLazyficationPass::shouldLazifyCallsitePGO(CallInst *CI,
-                                                     uint8_t argIdx) {
-  WyvernCallSiteProfInfo *prof_info = profileInfo[CI].get();
+/// Replaces the uses of @param placeholder in callee clone @param F, which
+/// stand for the lazified parameter, with calls to delegate
+/// @param slicedFunction on the environment @param envArgs. With @param memo,
+/// the value and whether it was computed are kept in SSA registers, so the
+/// delegate is called at most once per invocation of the clone.
+static void forceScalarThunk(Function *F, Value *placeholder,
+                             Function *slicedFunction,
+                             ArrayRef<Value *> envArgs, bool memo) {
+  Type *valueType = placeholder->getType();
+  IRBuilder<> builder(&*F->getEntryBlock().getFirstInsertionPt());
+  AllocaInst *memoValAlloca = nullptr, *memoFlagAlloca = nullptr;
+  if (memo) {
+    memoValAlloca =
+        builder.CreateAlloca(valueType, nullptr, "_wyvern_memo_val_addr");
+    memoFlagAlloca = builder.CreateAlloca(builder.getInt1Ty(), nullptr,
+                                          "_wyvern_memo_flag_addr");
+    builder.CreateStore(builder.getFalse(), memoFlagAlloca);
+  }
 
-  if (!prof_info) {
-    return false;
+  SmallVector<Use *> uses;
+  for (Use &U : placeholder->uses()) {
+    uses.push_back(&U);
   }
+  // Placement is computed before the memoization checks change the CFG. The
+  // value loaded at each point dominates everything the point dominated.
+  ForcePlacement placement = placeForces(*F, uses);
+  NumForcesPlaced += placement.Points.size();
+  NumForcesHoisted += placement.NumHoisted;
+  SmallVector<Value *> values;
+  for (Instruction *point : placement.Points) {
+    builder.SetInsertPoint(point);
+
+    if (WyvernThunkDebugging) {
+      std::string dbg_fmt;
+      raw_string_ostream rso(dbg_fmt);
+      rso << "== Wyvern Debugging ==\nCalling thunk!\n";
+      rso << "\tInvoking function: " << F->getName() << "\n";
+      rso << "======================\n";
+      generatePrintf(dbg_fmt, {}, builder);
+    }
+
+    if (memo) {
+      // if (!memo_flag) { memo_val = delegate(env); memo_flag = true; }
+      Value *isMemoized = builder.CreateLoad(builder.getInt1Ty(),
+                                             memoFlagAlloca, "_wyvern_memo_flag");
+      Instruction *computeTerm = SplitBlockAndInsertIfThen(
+          builder.CreateNot(isMemoized), point, false);
+      builder.SetInsertPoint(computeTerm);
+    }
+    CallInst *thunkCall =
+        builder.CreateCall(slicedFunction, envArgs, "_wyvern_thunkcall");
+    thunkCall->setCallingConv(CallingConv::Fast);
+    setThunkCallDebugLoc(*thunkCall);
+    if (!memo) {
+      values.push_back(thunkCall);
+      continue;
+    }
+    builder.CreateStore(thunkCall, memoValAlloca);
+    builder.CreateStore(builder.getTrue(), memoFlagAlloca);
+    builder.SetInsertPoint(point);
+    values.push_back(
+        builder.CreateLoad(valueType, memoValAlloca, "_wyvern_memo_val"));
+  }
+  for (auto &[use, pointIdx] : placement.Covering) {
+    use->set(values[pointIdx]);
+  }
+
+  if (memo) {
+    DominatorTree DT(*F);
+    PromoteMemToReg({memoValAlloca, memoFlagAlloca}, DT);
+  }
+}
+
+/// Clones function @param Callee, replacing its formal parameter of index
+/// @param index with the parameters of delegate @param slicedFunction, which
+/// hold the environment of the lazified value. The clone computes the value
+/// by calling the delegate, so no thunk is allocated at the call site. With
+/// @param memo, the delegate is called at most once per call to the clone.
+static Function *cloneCalleeFunctionScalar(Function &Callee, unsigned index,
+                                           Function *slicedFunction, bool memo,
+                                           Module &M) {
+  WyvernStageTimer timer("clone-callee", "Clone callee functions",
+                         Callee.getName());
+  SmallVector<Type *> argTypes;
+  for (auto &arg : Callee.args()) {
+    if (arg.getArgNo() != index) {
+      argTypes.push_back(arg.getType());
+      continue;
+    }
+    for (auto &envArg : slicedFunction->args()) {
+      argTypes.push_back(envArg.getType());
+    }
+  }
+
+  FunctionType *FT = FunctionType::get(Callee.getReturnType(), argTypes, false);
+  Function *newCallee = Function::Create(FT, Function::InternalLinkage,
+                                         "_wyvern_calleeclone", M);
+
+  // The lazified parameter is mapped to a placeholder, whose uses are forced
+  // once the body is cloned.
+  Instruction *placeholder =
+      new FreezeInst(UndefValue::get(Callee.getArg(index)->getType()));
+  SmallVector<Value *> envArgs;
+  ValueToValueMapTy vMap;
+  unsigned newIdx = 0;
+  for (auto &arg : Callee.args()) {
+    if (arg.getArgNo() != index) {
+      vMap[&arg] = newCallee->getArg(newIdx);
+      newCallee->getArg(newIdx++)->setName(arg.getName());
+      continue;
+    }
+    vMap[&arg] = placeholder;
+    for (auto &envArg : slicedFunction->args()) {
+      newCallee->getArg(newIdx)->setName(envArg.getName());
+      envArgs.push_back(newCallee->getArg(newIdx++));
+    }
+  }
+
+  SmallVector<ReturnInst *, 4> Returns;
+  CloneFunctionInto(newCallee, &Callee, vMap,
+                    CloneFunctionChangeType::LocalChangesOnly, Returns);
+  newCallee->setMetadata(PromisingArgsMetadataName, nullptr);
+  dropMemoryAttrs(*newCallee);
+  if (newCallee->getCallingConv() == CallingConv::C) {
+    newCallee->setCallingConv(CallingConv::Fast);
+  }
+  forceScalarThunk(newCallee, placeholder, slicedFunction, envArgs, memo);
+  placeholder->deleteValue();
+
+  inlineDelegateCalls(*newCallee, *slicedFunction);
+  verifyFunction(*newCallee);
+
+  return nameByStructuralHash(newCallee, "_wyvern_calleeclone_" +
+                                             Callee.getName().str() + "_" +
+                                             std::to_string(index) + "_");
+}
+
+Optional<double> WyvernLazyficationPass::getProfileEvalRate(CallInst *CI,
+                                                            uint8_t argIdx) {
+  auto it = profileInfo.find(CI);
+  if (it == profileInfo.end() || !it->second) {
+    return None;
+  }
+  WyvernCallSiteProfInfo *prof_info = it->second.get();
 
   if (prof_info->_uniqueEvals.size() <= argIdx) {
-    return false;
+    return None;
   }
 
   uint64_t numCalls = prof_info->_numCalls;
   uint64_t uniqueEvals = prof_info->_uniqueEvals[argIdx];
-  double evalRate = (double)uniqueEvals / (double)numCalls;
-
-  if (evalRate < WyvernPGOThreshold) {
-    return true;
-  }
+  return (double)uniqueEvals / (double)numCalls;
+}
 
-  return false;
+bool WyvernLazyficationPass::shouldLazifyCallsitePGO(CallInst *CI,
+                                                     uint8_t argIdx) {
+  Optional<double> evalRate = getProfileEvalRate(CI, argIdx);
+  return evalRate && *evalRate < WyvernPGOThreshold;
 }
 
 bool WyvernLazyficationPass::loadProfileInfo(Module &M, std::string path) {
+  WyvernStageTimer timer("load-profile", "Load profile information", path);
   std::string line;
   std::ifstream profileReportFile(path);
   if (!profileReportFile.is_open()) {
@@ -320,42 +758,48 @@ bool WyvernLazyficationPass::loadProfileInfo(Module &M, std::string path) {
   return true;
 }
 
+/// Aligns thunk @param thunkAlloca to the next power of two of its size, if
+/// it fits in a cache line, so forcing the thunk touches a single line.
+static void alignThunkAlloca(AllocaInst &thunkAlloca) {
+  const DataLayout &DL = thunkAlloca.getModule()->getDataLayout();
+  uint64_t size = DL.getTypeAllocSize(thunkAlloca.getAllocatedType());
+  if (size <= 64) {
+    thunkAlloca.setAlignment(
+        std::max(thunkAlloca.getAlign(), Align(PowerOf2Ceil(size))));
+  }
+}
+
 static void generateThunkInitializationCode(IRBuilder<> &builder,
                                             ProgramSlice &slice,
                                             AllocaInst *thunkAlloca,
                                             Function *delegateFunction,
                                             bool memo) {
   StructType *thunkStructType = slice.getThunkStructType(memo);
+  StructType *thunkHeaderType =
+      cast<StructType>(thunkStructType->getStructElementType(0));
+  Value *thunkHeaderGEP = builder.CreateStructGEP(
+      thunkStructType, thunkAlloca, 0, "_wyvern_thunk_header_gep");
 
-  // initialize thunk with:
-  // struct thunk {
+  // initialize thunk header with:
+  // struct header {
   //   fptr = delegateFunction
   // }
-  Value *thunkFPtrGEP = builder.CreateStructGEP(thunkStructType, thunkAlloca, 0,
-                                                "_wyvern_thunk_fptr_gep");
+  Value *thunkFPtrGEP = builder.CreateStructGEP(
+      thunkHeaderType, thunkHeaderGEP, 0, "_wyvern_thunk_fptr_gep");
   builder.CreateStore(delegateFunction, thunkFPtrGEP);
 
-  if (memo) {
-    // memoized thunks also have their memoization flag:
-    // struct thunk {
-    //   ...
-    //   memo_flag = false
-    //   ...
-    // }
-    Value *thunkFlagGEP = builder.CreateStructGEP(thunkStructType, thunkAlloca,
-                                                  2, "_wyvern_thunk_flag_gep");
-    builder.CreateStore(builder.getInt1(0), thunkFlagGEP);
-  }
-
-  // add initialization of thunk environment:
+  // memoized thunks need no other initialization: their value is only read
+  // once the delegate replaces itself in fptr.
+
+  // add initialization of thunk environment, after its header:
   // struct thunk {
-  //   ...
+  //   header
   //   arg1 = x
   //   arg2 = y
   //   ...
   // }
-  uint64_t i = (memo ? 3 : 1);
-  for (auto &arg : slice.getOrigFunctionArgs()) {
+  uint64_t i = 1;
+  for (auto &arg : slice.getEnvironment()) {
     Value *thunkArgGEP =
         builder.CreateStructGEP(thunkStructType, thunkAlloca, i,
                                 "_wyvern_thunk_arg_gep_" + arg->getName());
@@ -371,15 +815,7 @@ static void generateThunkInitializationCode(IRBuilder<> &builder,
     rso << "== Wyvern Debugging ==\nInitializing thunk with:\n";
     rso << "\tdelegateFunction = " << delegateFunction->getName().str() << "\n";
 
-    if (memo) {
-      rso << "\t";
-      builder.getInt1(0)->getType()->print(rso);
-      rso << " memo_flag = ";
-      builder.getInt1(0)->print(rso);
-      rso << "\n";
-    }
-
-    for (auto &arg : slice.getOrigFunctionArgs()) {
+    for (auto &arg : slice.getEnvironment()) {
       rso << "\t";
       arg->getType()->print(rso);
       rso << " " << arg->getName() << " = ";
@@ -401,6 +837,196 @@ static void generateThunkInitializationCode(IRBuilder<> &builder,
   }
 }
 
+/// Returns whether every call to @param Callee forces its parameter of index
+/// @param index at most once, once its forces are placed by placeForces: no
+/// force is in a loop and none may reach another.
+static bool isForcedAtMostOnce(Function &Callee, unsigned index) {
+  SmallVector<Use *> uses;
+  for (Use &U : Callee.getArg(index)->uses()) {
+    if (!isa<Instruction>(U.getUser())) {
+      return false;
+    }
+    uses.push_back(&U);
+  }
+  SmallVector<Instruction *> forcingPoints = placeForces(Callee, uses).Points;
+
+  DominatorTree DT(Callee);
+  LoopInfo LI(DT);
+  for (unsigned i = 0; i < forcingPoints.size(); ++i) {
+    if (LI.getLoopFor(forcingPoints[i]->getParent())) {
+      return false;
+    }
+    for (unsigned j = i + 1; j < forcingPoints.size(); ++j) {
+      if (isPotentiallyReachable(forcingPoints[i], forcingPoints[j], nullptr,
+                                 &DT, &LI) ||
+          isPotentiallyReachable(forcingPoints[j], forcingPoints[i], nullptr,
+                                 &DT, &LI)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool WyvernLazyficationPass::isCalleeForcedAtMostOnce(Function &callee,
+                                                      unsigned index) {
+  auto key = std::make_pair(&callee, index);
+  auto it = forcedAtMostOnce.find(key);
+  if (it == forcedAtMostOnce.end()) {
+    it = forcedAtMostOnce.emplace(key, isForcedAtMostOnce(callee, index)).first;
+  }
+  return it->second;
+}
+
+/// Returns the point where a thunk whose value is computed by @param def and
+/// forced at @param forcingPoints is initialized: the nearest common
+/// dominator of the forcing points, before the first of them in that block.
+/// The point is moved out of the loops that do not contain @param def, so
+/// their iterations share the thunk.
+static Instruction *
+getThunkInitializationPoint(ArrayRef<Instruction *> forcingPoints,
+                            Instruction *def, DominatorTree &DT,
+                            LoopInfo &LI) {
+  BasicBlock *commonDom = nullptr;
+  for (Instruction *point : forcingPoints) {
+    if (!DT.isReachableFromEntry(point->getParent())) {
+      continue;
+    }
+    commonDom = commonDom ? DT.findNearestCommonDominator(commonDom,
+                                                          point->getParent())
+                          : point->getParent();
+  }
+  if (!commonDom) {
+    return def->getParent()->getTerminator();
+  }
+
+  while (Loop *L = LI.getLoopFor(commonDom)) {
+    if (L->contains(def)) {
+      break;
+    }
+    commonDom = DT.getNode(L->getHeader())->getIDom()->getBlock();
+  }
+
+  Instruction *initPoint = commonDom->getTerminator();
+  for (Instruction *point : forcingPoints) {
+    if (point->getParent() == commonDom && point->comesBefore(initPoint)) {
+      initPoint = point;
+    }
+  }
+  return initPoint;
+}
+
+/// Lazifies argument @param index of call @param CI through a thunk holding
+/// the environment of @param slice, allocated in the caller. If
+/// @param specialize, the callee clone calls the delegate directly. With
+/// @param memo, the thunk is memoized. Returns the delegate.
+Function *WyvernLazyficationPass::lazifyCallsiteWithThunk(
+    CallInst &CI, uint8_t index, ProgramSlice &slice, bool specialize,
+    bool memo, Module &M) {
+  Function *caller = CI.getFunction();
+  Function *callee = CI.getCalledFunction();
+  Instruction *lazyfiableArg = cast<Instruction>(CI.getArgOperand(index));
+  SlicingContext &context = getSlicingContext(*caller);
+
+  IRBuilder<> builder(M.getContext());
+  builder.SetInsertPoint(&*(caller->getEntryBlock().getFirstInsertionPt()));
+
+  Function *delegateFunction, *newCallee;
+  StructType *thunkStructType, *thunkHeaderType;
+
+  if (memo) {
+    // Memoized thunks point to the delegate of pre-forced thunks once their
+    // value is cached.
+    StructType *memoizedThunkType =
+        StructType::get(getThunkHeaderType(lazyfiableArg->getType(), true));
+    delegateFunction = slice.memoizedOutline(
+        getForcedThunkDelegate(memoizedThunkType, true /*memo*/, M));
+  } else {
+    delegateFunction = slice.outline();
+  }
+  setGeneratedFunctionLinkage(*delegateFunction, foldAcrossModules());
+  thunkStructType = slice.getThunkStructType(memo);
+  thunkHeaderType = cast<StructType>(thunkStructType->getStructElementType(0));
+
+  AllocaInst *thunkAlloca =
+      builder.CreateAlloca(thunkStructType, nullptr, "_wyvern_thunk_alloca");
+  alignThunkAlloca(*thunkAlloca);
+  // The callee and the delegate take a pointer to the thunk's header.
+  Value *thunkHeader =
+      builder.CreateStructGEP(thunkStructType, thunkAlloca, 0, "_wyvern_thunk");
+
+  // The thunk is initialized where it is first needed rather than where the
+  // argument was computed, so paths that never reach a forcing point skip
+  // the environment stores.
+  SmallVector<Instruction *> forcingPoints;
+  for (Use &U : lazyfiableArg->uses()) {
+    if (isa<Instruction>(U.getUser())) {
+      forcingPoints.push_back(getForcingPoint(U));
+    }
+  }
+  DominatorTree &DT = context.getDomTree();
+  LoopInfo &LI = context.getLoopInfo();
+  Instruction *initPoint =
+      getThunkInitializationPoint(forcingPoints, lazyfiableArg, DT, LI);
+  builder.SetInsertPoint(initPoint);
+
+  // The thunk is only live from its initialization to the call, if that is
+  // its only use and no iteration of a loop reuses it, so stack coloring may
+  // share its slot with other thunks.
+  bool emitLifetime =
+      lazyfiableArg->hasOneUse() &&
+      LI.getLoopFor(initPoint->getParent()) == LI.getLoopFor(CI.getParent());
+  const DataLayout &DL = M.getDataLayout();
+  ConstantInt *thunkSize = builder.getInt64(
+      DL.getTypeAllocSize(thunkAlloca->getAllocatedType()).getFixedSize());
+  if (emitLifetime) {
+    builder.CreateLifetimeStart(thunkAlloca, thunkSize);
+  }
+
+  generateThunkInitializationCode(builder, slice, thunkAlloca, delegateFunction,
+                                  memo);
+
+  if (emitLifetime) {
+    builder.SetInsertPoint(CI.getNextNode());
+    builder.CreateLifetimeEnd(thunkAlloca, thunkSize);
+  }
+
+  Function *specializedFor = specialize ? delegateFunction : nullptr;
+  auto tuple = std::make_tuple(callee, index, specializedFor, memo);
+  Function *previouslyClonedCallee = clonedCallees[tuple];
+  if (previouslyClonedCallee) {
+    newCallee = previouslyClonedCallee;
+  } else {
+    newCallee = cloneCalleeFunction(*callee, index, specializedFor, thunkHeader,
+                                    thunkHeaderType, M);
+    setGeneratedFunctionLinkage(*newCallee, foldAcrossModules());
+    clonedCallees[tuple] = newCallee;
+  }
+
+  // The call site and the users of the lazified argument are about to depend
+  // on the thunk instead, so their dependences must be updated.
+  SmallVector<Instruction *> changedUsers = {&CI};
+  for (User *U : lazyfiableArg->users()) {
+    if (Instruction *UserI = dyn_cast<Instruction>(U)) {
+      changedUsers.push_back(UserI);
+    }
+  }
+
+  CI.setCalledFunction(newCallee);
+  CI.setCallingConv(newCallee->getCallingConv());
+  CI.setArgOperand(index, thunkHeader);
+  // The callee now reads the caller's stack.
+  CI.setTailCall(false);
+  dropMemoryAttrs(CI);
+  removeAttributesFromThunkArgument(CI, index);
+  removeAttributesFromThunkArgument(*newCallee, index);
+  updateThunkArgUses(caller, thunkHeader, thunkHeaderType, delegateFunction,
+                     lazyfiableArg);
+  context.updateDependences(changedUsers);
+
+  return delegateFunction;
+}
+
 /// Attempts to lazify a given call site, in terms of its actual parameter with
 /// the given index.
 bool WyvernLazyficationPass::lazifyCallsite(CallInst &CI, uint8_t index,
@@ -408,20 +1034,58 @@ bool WyvernLazyficationPass::lazifyCallsite(CallInst &CI, uint8_t index,
   LLVM_DEBUG(dbgs() << "Analyzing callsite: " << CI << " for argument "
                     << *CI.getOperand(index) << "\n");
 
+  Function *caller = CI.getParent()->getParent();
+  OptimizationRemarkEmitter &ORE = GetORE(*caller);
+  Optional<double> evalRate =
+      WyvernEnablePGO ? getProfileEvalRate(&CI, index) : None;
+
   Instruction *lazyfiableArg;
   if (!(lazyfiableArg = dyn_cast<Instruction>(CI.getArgOperand(index)))) {
     LLVM_DEBUG(dbgs() << "Argument is not lazyfiable!\n");
+    emitMissedRemark(ORE, CI, index, "NotInstruction",
+                     "argument is not computed by an instruction", nullptr,
+                     None, evalRate);
     return false;
   }
 
-  Function *caller = CI.getParent()->getParent();
-  TargetLibraryInfo &TLI =
-      getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(*caller);
-  ProgramSlice slice =
-      ProgramSlice(*lazyfiableArg, *caller, CI, AA, TLI, WyvernThunkDebugging);
+  TargetLibraryInfo &TLI = GetTLI(*caller);
+  SlicingContext &context = getSlicingContext(*caller);
+  ProgramSlice slice = ProgramSlice(*lazyfiableArg, *caller, CI, context, AA,
+                                    TLI, WyvernThunkDebugging);
+
+  // Rejections are only cached for callers not yet changed by this pass,
+  // since the call site numbering is that of the caller's original body.
+  AnalysisCache *cache = AnalysisCache::get();
+  Optional<OutlineVerdict> verdict;
+  StringRef callerHash;
+  unsigned callSiteNumber = 0;
+  if (cache && !modifiedCallers.count(caller)) {
+    std::string &hash = functionHashes[caller];
+    if (hash.empty()) {
+      hash = computeFunctionHash(*caller);
+    }
+    callerHash = hash;
+    callSiteNumber = context.getNumber(&CI);
+    verdict = cache->getOutlineVerdict(callerHash, callSiteNumber, index);
+    if (verdict) {
+      ++NumOutlineVerdictsFromCache;
+    }
+  }
+
+  if (!verdict) {
+    bool canOutline = slice.canOutline();
+    const OutlineRejection &rejection = slice.getRejection();
+    verdict = OutlineVerdict{canOutline, rejection.Key.str(),
+                             rejection.Reason.str()};
+    if (!callerHash.empty()) {
+      cache->setOutlineVerdict(callerHash, callSiteNumber, index, *verdict);
+    }
+  }
 
-  if (!slice.canOutline()) {
+  if (!verdict->CanOutline) {
     LLVM_DEBUG(dbgs() << "Cannot lazify argument. Slice is not outlineable!\n");
+    emitMissedRemark(ORE, CI, index, verdict->Key, verdict->Reason,
+                     slice.getRejection().Culprit, slice.size(), evalRate);
     return false;
   }
 
@@ -429,12 +1093,17 @@ bool WyvernLazyficationPass::lazifyCallsite(CallInst &CI, uint8_t index,
   if (!callee || callee->isDeclaration()) {
     LLVM_DEBUG(dbgs() << "Cannot lazify argument. Callee function definition "
                          "is not available for cloning!\n");
+    emitMissedRemark(ORE, CI, index, "CalleeNotAvailable",
+                     "callee definition is not available for cloning", nullptr,
+                     slice.size(), evalRate);
     return false;
   }
 
   if (callee->isVarArg()) {
     LLVM_DEBUG(dbgs() << "Cannot lazify argument. Callee function has variable "
                          "number of input arguments!\n");
+    emitMissedRemark(ORE, CI, index, "VarArgCallee", "callee is variadic",
+                     nullptr, slice.size(), evalRate);
     return false;
   }
 
@@ -442,10 +1111,17 @@ bool WyvernLazyficationPass::lazifyCallsite(CallInst &CI, uint8_t index,
   if (callee_arg->getNumUses() == 0) {
     LLVM_DEBUG(dbgs() << "Will not lazify argument because it has no uses in "
                          "callee function! Possibly @this pointer?\n");
+    emitMissedRemark(ORE, CI, index, "UnusedArgument",
+                     "argument is not used by the callee", nullptr,
+                     slice.size(), evalRate);
     return false;
   }
 
   ++NumCallsitesLazified;
+  if (!slice.getEagerValues().empty()) {
+    ++NumPartialSlices;
+  }
+  modifiedCallers.insert(caller);
   if (lazifiedFunctions.emplace(std::make_pair(caller, lazyfiableArg)).second) {
     ++NumFunctionsLazified;
   }
@@ -454,47 +1130,74 @@ bool WyvernLazyficationPass::lazifyCallsite(CallInst &CI, uint8_t index,
                     << caller->getName() << " call to " << callee->getName()
                     << "\n");
 
-  IRBuilder<> builder(M.getContext());
-  builder.SetInsertPoint(&*(caller->getEntryBlock().getFirstInsertionPt()));
-
-  Function *delegateFunction, *newCallee;
-  StructType *thunkStructType;
-
-  delegateFunction =
-      WyvernLazyficationMemoization ? slice.memoizedOutline() : slice.outline();
-  thunkStructType = slice.getThunkStructType(WyvernLazyficationMemoization);
-
-  AllocaInst *thunkAlloca =
-      builder.CreateAlloca(thunkStructType, nullptr, "_wyvern_thunk_alloca");
-
-  if (isa<PHINode>(lazyfiableArg)) {
-    builder.SetInsertPoint(
-        &*(lazyfiableArg->getParent()->getFirstInsertionPt()));
-  } else {
-    builder.SetInsertPoint(lazyfiableArg);
+  Function *delegateFunction;
+  // A clone specialized for the delegate calls it directly, and may inline
+  // it, but only serves this slice. Parameters lazified at several call sites
+  // share a single clone instead, which calls the delegate stored in the
+  // thunk.
+  bool specialize =
+      !WyvernUnifyCallees && numCandidateSites[{callee, index}] <= 1;
+  // A call site in a loop whose argument is computed outside of it reuses the
+  // thunk, initialized before the loop, in every iteration, so the slice is
+  // evaluated at most once per loop when memoized.
+  Loop *callSiteLoop = context.getLoopInfo().getLoopFor(CI.getParent());
+  bool reusedAcrossIterations =
+      callSiteLoop && !callSiteLoop->contains(lazyfiableArg);
+  if (reusedAcrossIterations) {
+    ++NumCallsitesInLoops;
   }
-
-  generateThunkInitializationCode(builder, slice, thunkAlloca, delegateFunction,
-                                  WyvernLazyficationMemoization);
-
-  auto tuple = std::make_tuple(callee, index, thunkStructType);
-  Function *previouslyClonedCallee = clonedCallees[tuple];
-  if (previouslyClonedCallee) {
-    newCallee = previouslyClonedCallee;
+  // Memoization only pays off if the value may be forced more than once, by
+  // the callee or by other uses in the caller.
+  bool memo = WyvernLazyficationMemoization;
+  if (memo && WyvernAdaptiveMemoization && !reusedAcrossIterations &&
+      lazyfiableArg->hasOneUse() &&
+      isCalleeForcedAtMostOnce(*callee, index)) {
+    LLVM_DEBUG(dbgs() << "Argument is forced at most once, so its thunk is "
+                         "not memoized\n");
+    memo = false;
+    ++NumCallsitesNotMemoized;
+  }
+  SmallVector<Value *> environment = slice.getEnvironment();
+  if (specialize && environment.size() <= WyvernScalarEnvSize &&
+      !reusedAcrossIterations && lazyfiableArg->hasOneUse() &&
+      !CI.isMustTailCall()) {
+    // The thunk would not escape the call, so its environment is passed to
+    // the clone as parameters, and the clone keeps the memoized value in
+    // registers.
+    delegateFunction = slice.scalarOutline();
+    setGeneratedFunctionLinkage(*delegateFunction, foldAcrossModules());
+    Function *newCallee =
+        cloneCalleeFunctionScalar(*callee, index, delegateFunction, memo, M);
+    setGeneratedFunctionLinkage(*newCallee, foldAcrossModules());
+    clonedCallees[std::make_tuple(callee, index, delegateFunction, memo)] =
+        newCallee;
+    // The call site takes a different number of arguments, so it is replaced
+    // once all call sites are lazified, as candidates still refer to it.
+    scalarCallSites.push_back({&CI, index, newCallee, environment});
+    ++NumScalarThunks;
   } else {
-    newCallee = cloneCalleeFunction(*callee, index, *delegateFunction,
-                                    thunkAlloca, thunkStructType, M);
-    clonedCallees[tuple] = newCallee;
+    delegateFunction =
+        lazifyCallsiteWithThunk(CI, index, slice, specialize, memo, M);
   }
 
-  CI.setCalledFunction(newCallee);
-  CI.setArgOperand(index, thunkAlloca);
-  removeAttributesFromThunkArgument(CI, index);
-  removeAttributesFromThunkArgument(*newCallee, index);
-  updateThunkArgUses(caller, thunkAlloca, thunkStructType, delegateFunction,
-                     lazyfiableArg);
-
   uint64_t sliceSize = getNumberOfInsts(*delegateFunction);
+  ORE.emit([&]() {
+    OptimizationRemark remark(RemarkPassName, "Lazified", &CI);
+    remark << "lazified argument " << ore::NV("ArgNo", index)
+           << " of call to " << ore::NV("Callee", callee)
+           << " with a slice of " << ore::NV("SliceSize", sliceSize)
+           << " instructions";
+    if (evalRate) {
+      // Instructions of the slice that are expected to be skipped per call.
+      remark << "; profile evaluation rate "
+             << ore::NV("ProfileRate", formatv("{0:F3}", *evalRate).str())
+             << ", estimated benefit "
+             << ore::NV("EstimatedBenefit", static_cast<uint64_t>(std::lround(
+                                                sliceSize * (1 - *evalRate))))
+             << " instructions per call";
+    }
+    return remark;
+  });
   TotalSliceSize += sliceSize;
   if (LargestSliceSize < sliceSize) {
     LargestSliceSize = sliceSize;
@@ -506,21 +1209,124 @@ bool WyvernLazyficationPass::lazifyCallsite(CallInst &CI, uint8_t index,
   return true;
 }
 
-bool WyvernLazyficationPass::runOnModule(Module &M) {
-  SmallestSliceSize = std::numeric_limits<unsigned int>::max();
-  FindLazyfiableAnalysis &FLA = getAnalysis<FindLazyfiableAnalysis>();
+void WyvernLazyficationPass::precomputeSlicingContexts(
+    const std::map<Function *, SmallVector<Instruction *>> &criteria) {
+  WyvernStageTimer timer("slicing-contexts", "Build slicing contexts");
+  std::vector<Function *> functions;
+  for (auto &entry : criteria) {
+    functions.push_back(entry.first);
+  }
+  std::vector<std::unique_ptr<SlicingContext>> contexts(functions.size());
+  parallelForEachFunction(functions, [&](Function &F) {
+    auto it = std::lower_bound(functions.begin(), functions.end(), &F);
+    auto context = std::make_unique<SlicingContext>(F);
+    context->computeSlices(criteria.at(&F));
+    contexts[it - functions.begin()] = std::move(context);
+  });
+
+  for (unsigned int i = 0; i < functions.size(); ++i) {
+    slicingContexts[functions[i]] = std::move(contexts[i]);
+  }
+}
 
-  if (!WyvernLazyfication) {
+/// Returns whether function @param F is too large for its call sites to be
+/// analyzed for lazification.
+static bool exceedsInstructionBudget(const Function &F) {
+  return WyvernMaxFunctionInsts &&
+         F.getInstructionCount() > WyvernMaxFunctionInsts;
+}
+
+/// Adds argument @param arg of a candidate call site in @param caller to the
+/// slicing criteria to be computed beforehand, as long as the caller is within
+/// the instruction and candidate budgets.
+static void
+addSlicingCriterion(std::map<Function *, SmallVector<Instruction *>> &criteria,
+                    Function *caller, Value *arg) {
+  Instruction *argInst = dyn_cast<Instruction>(arg);
+  if (!argInst || exceedsInstructionBudget(*caller)) {
+    return;
+  }
+  SmallVector<Instruction *> &functionCriteria = criteria[caller];
+  if (!WyvernMaxCandidatesPerFunction ||
+      functionCriteria.size() < WyvernMaxCandidatesPerFunction) {
+    functionCriteria.push_back(argInst);
+  }
+}
+
+bool WyvernLazyficationPass::isWithinBudget(CallInst &CI, uint8_t index) {
+  Function &caller = *CI.getFunction();
+  if (exceedsInstructionBudget(caller)) {
+    ++NumCallsitesSkippedFunctionSize;
+    emitMissedRemark(GetORE(caller), CI, index, "FunctionTooLarge",
+                     "caller exceeds the instruction budget");
     return false;
   }
 
-  bool changed = false;
+  if (WyvernMaxCandidatesPerFunction &&
+      ++numCandidates[&caller] > WyvernMaxCandidatesPerFunction) {
+    ++NumCallsitesSkippedCandidateLimit;
+    emitMissedRemark(GetORE(caller), CI, index, "TooManyCandidates",
+                     "caller exceeds the candidate budget");
+    return false;
+  }
+
+  if (WyvernTimeBudget > 0 && std::chrono::steady_clock::now() > deadline) {
+    LLVM_DEBUG(dbgs() << "Lazification time budget exceeded, skipping call "
+                         "site in "
+                      << caller.getName() << "\n");
+    ++NumCallsitesSkippedTimeBudget;
+    emitMissedRemark(GetORE(caller), CI, index, "TimeBudgetExceeded",
+                     "module exceeds the compile-time budget");
+    return false;
+  }
+  return true;
+}
+
+SlicingContext &WyvernLazyficationPass::getSlicingContext(Function &F) {
+  std::unique_ptr<SlicingContext> &context = slicingContexts[&F];
+  if (!context) {
+    WyvernStageTimer timer("slicing-contexts", "Build slicing contexts",
+                           F.getName());
+    context = std::make_unique<SlicingContext>(F);
+  }
+  return *context;
+}
+
+bool WyvernLazyficationPass::lazifyModule(Module &M, LazyfiableInfo &FLA) {
+  SmallestSliceSize = std::numeric_limits<unsigned int>::max();
+  deadline = std::chrono::steady_clock::now() +
+             std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                 std::chrono::duration<double>(WyvernTimeBudget));
+  numCandidates.clear();
+  numCandidateSites.clear();
+  forcedAtMostOnce.clear();
+
+  // Export the analysis' results before lazifying, so ThinLTO backends that
+  // import functions from this module can lazify call sites to them.
+  bool changed = FLA.exportPromisingArgs(M);
   if (WyvernEnablePGO) {
     if (!loadProfileInfo(M, WyvernPGOFilePath)) {
       errs() << "Failed to load profile info for PGO! Exiting...\n";
       return false;
     }
 
+    std::map<Function *, SmallVector<Instruction *>> criteria;
+    for (auto &entry : profileInfo) {
+      CallInst *CI = dyn_cast<CallInst>(entry.first);
+      if (!CI) {
+        continue;
+      }
+      for (uint8_t argIdx = 0; argIdx < CI->arg_size(); ++argIdx) {
+        if (isCandidateCallee(CI->getCalledFunction()) &&
+            shouldLazifyCallsitePGO(CI, argIdx)) {
+          ++numCandidateSites[{CI->getCalledFunction(), argIdx}];
+          addSlicingCriterion(criteria, CI->getFunction(),
+                              CI->getArgOperand(argIdx));
+        }
+      }
+    }
+    precomputeSlicingContexts(criteria);
+
     for (Function &F : M) {
       for (inst_iterator I = inst_begin(F); I != inst_end(F); ++I) {
         if (!isa<CallInst>(&*I)) {
@@ -528,11 +1334,18 @@ bool WyvernLazyficationPass::runOnModule(Module &M) {
         }
         CallInst *CI = cast<CallInst>(&*I);
         for (uint8_t argIdx = 0; argIdx < CI->arg_size(); ++argIdx) {
-          if (shouldLazifyCallsitePGO(CI, argIdx)) {
-            AAResults *AA =
-                &getAnalysis<AAResultsWrapperPass>(F).getAAResults();
-            changed = lazifyCallsite(*CI, argIdx, M, AA);
-            if (changed) {
+          Optional<double> evalRate = getProfileEvalRate(CI, argIdx);
+          if (evalRate && !shouldLazifyCallsitePGO(CI, argIdx)) {
+            emitMissedRemark(GetORE(F), *CI, argIdx, "FrequentlyEvaluated",
+                             "argument is evaluated too often", nullptr, None,
+                             evalRate);
+          }
+          if (isCandidateCallee(CI->getCalledFunction()) &&
+              shouldLazifyCallsitePGO(CI, argIdx) &&
+              isWithinBudget(*CI, argIdx)) {
+            AAResults *AA = &GetAA(F);
+            if (lazifyCallsite(*CI, argIdx, M, AA)) {
+              changed = true;
               break;
             }
           }
@@ -542,31 +1355,348 @@ bool WyvernLazyficationPass::runOnModule(Module &M) {
   }
 
   else {
+    std::map<Function *, SmallVector<Instruction *>> criteria;
+    for (auto &pair : FLA.getLazyfiableCallSites()) {
+      Function *callee = pair.first->getCalledFunction();
+      if (isCandidateCallee(callee) &&
+          FLA.getPromisingFunctionArgs().count(
+              std::make_pair(callee, pair.second)) > 0) {
+        ++numCandidateSites[{callee, pair.second}];
+        addSlicingCriterion(criteria, pair.first->getFunction(),
+                            pair.first->getArgOperand(pair.second));
+      }
+    }
+    precomputeSlicingContexts(criteria);
+
+    SmallPtrSet<CallInst *, 16> lazifiedCallSites;
     for (auto &pair : FLA.getLazyfiableCallSites()) {
       CallInst *CI = pair.first;
       uint8_t argIdx = pair.second;
       Function *caller = CI->getParent()->getParent();
       Function *callee = pair.first->getCalledFunction();
 
-      AAResults *AA =
-          &getAnalysis<AAResultsWrapperPass>(*caller).getAAResults();
-      if (FLA.getPromisingFunctionArgs().count(std::make_pair(callee, argIdx)) >
+      // Call sites already lazified in terms of another argument now call a
+      // clone of the callee, which is not analyzed.
+      if (lazifiedCallSites.count(CI)) {
+        continue;
+      }
+      if (!isCandidateCallee(callee)) {
+        continue;
+      }
+      if (FLA.getPromisingFunctionArgs().count(std::make_pair(callee, argIdx)) ==
           0) {
-        changed = lazifyCallsite(*CI, argIdx, M, AA);
+        emitMissedRemark(GetORE(*caller), *CI, argIdx, "NotPromising",
+                         "callee may use the argument on every path");
+        continue;
+      }
+      AAResults *AA = &GetAA(*caller);
+      if (isWithinBudget(*CI, argIdx) && lazifyCallsite(*CI, argIdx, M, AA)) {
+        lazifiedCallSites.insert(CI);
+        changed = true;
       }
     }
   }
 
+  rewriteScalarCallSites();
+
   if (SmallestSliceSize == std::numeric_limits<unsigned int>::max()) {
     SmallestSliceSize = 0;
   }
 
+  if (AnalysisCache *cache = AnalysisCache::get()) {
+    cache->flush();
+  }
+
+  if (WyvernUnifyCallees) {
+    unifyCallees(M);
+  }
+  removeReplacedCallees();
+
   return changed;
 }
 
+bool WyvernLazyficationPass::foldAcrossModules() const {
+  return !wholeProgram && !WyvernInternalize;
+}
+
+bool WyvernLazyficationPass::isCandidateCallee(const Function *callee) const {
+  return !importedCalleesOnly ||
+         (callee && callee->hasAvailableExternallyLinkage());
+}
+
+/// Returns the delegate of pre-forced thunks of type @param thunkStructType,
+/// which returns the value already stored in the thunk: the memoized value if
+/// @param memo is set, or the only field of the environment otherwise.
+Function *WyvernLazyficationPass::getForcedThunkDelegate(
+    StructType *thunkStructType, bool memo, Module &M) {
+  Function *&delegateFunction = forcedThunkDelegates[thunkStructType];
+  if (delegateFunction) {
+    return delegateFunction;
+  }
+
+  StructType *thunkHeaderType =
+      cast<StructType>(thunkStructType->getStructElementType(0));
+  PointerType *thunkFPtrType =
+      cast<PointerType>(thunkHeaderType->getStructElementType(0));
+  FunctionType *delegateFunctionType =
+      cast<FunctionType>(thunkFPtrType->getPointerElementType());
+  Function *F = Function::Create(delegateFunctionType,
+                                 Function::InternalLinkage,
+                                 "_wyvern_thunk_forced", M);
+  AttrBuilder attrs(M.getContext());
+  attrs.addAttribute(Attribute::ReadOnly);
+  attrs.addAttribute(Attribute::NoUnwind);
+  attrs.addAttribute(Attribute::WillReturn);
+  F->addFnAttrs(attrs);
+  F->setCallingConv(CallingConv::Fast);
+  F->arg_begin()->setName("_wyvern_thunkptr");
+
+  IRBuilder<> builder(BasicBlock::Create(M.getContext(), "entry", F));
+  Value *valueGEP;
+  if (memo) {
+    valueGEP = builder.CreateStructGEP(thunkHeaderType, F->arg_begin(), 1,
+                                       "_wyvern_memo_val_addr");
+  } else {
+    Value *thunk = builder.CreateBitCast(
+        F->arg_begin(), thunkStructType->getPointerTo(), "_wyvern_thunk");
+    valueGEP =
+        builder.CreateStructGEP(thunkStructType, thunk, 1, "_wyvern_val_addr");
+  }
+  builder.CreateRet(builder.CreateLoad(delegateFunctionType->getReturnType(),
+                                       valueGEP, "_wyvern_val"));
+
+  delegateFunction = nameByStructuralHash(F, "_wyvern_thunk_forced_");
+  setGeneratedFunctionLinkage(*delegateFunction, foldAcrossModules());
+  return delegateFunction;
+}
+
+/// Returns whether every use of function @param F is a direct call that may be
+/// redirected to a clone of it.
+static bool isOnlyCalledDirectly(Function &F) {
+  for (User *U : F.users()) {
+    CallInst *CI = dyn_cast<CallInst>(U);
+    if (!CI || CI->getCalledOperand() != &F || CI->isMustTailCall()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void WyvernLazyficationPass::unifyCallees(Module &M) {
+  // Callees lazified in terms of a single parameter, through a shared clone.
+  std::map<Function *, std::tuple<unsigned, Function *, bool>> unifiable;
+  std::set<Function *> excluded;
+  for (auto &[key, clone] : clonedCallees) {
+    auto [callee, index, specializedFor, memo] = key;
+    if (specializedFor || unifiable.count(callee)) {
+      excluded.insert(callee);
+    }
+    unifiable[callee] = {index, clone, memo};
+  }
+
+  for (auto &[callee, entry] : unifiable) {
+    auto [index, clone, memo] = entry;
+    callee->removeDeadConstantUsers();
+    if (excluded.count(callee) || !callee->hasLocalLinkage() ||
+        !isOnlyCalledDirectly(*callee)) {
+      continue;
+    }
+
+    LLVM_DEBUG(dbgs() << "Unifying " << callee->getName() << " with "
+                      << clone->getName() << "\n");
+    Type *valueType = callee->getArg(index)->getType();
+    StructType *thunkHeaderType = getThunkHeaderType(valueType, memo);
+    // Memoized pre-forced thunks hold the value as already memoized, so they
+    // are just a header. Otherwise, the value is their environment.
+    SmallVector<Type *> thunkTypes = {thunkHeaderType};
+    if (!memo) {
+      thunkTypes.push_back(valueType);
+    }
+    StructType *thunkStructType = StructType::get(M.getContext(), thunkTypes);
+    Function *forcedDelegate = getForcedThunkDelegate(thunkStructType, memo, M);
+
+    // Recursive calls within the callee are redirected as well, so that no
+    // use of it is left and it can be removed.
+    SmallVector<CallInst *> eagerCallSites;
+    for (User *U : callee->users()) {
+      eagerCallSites.push_back(cast<CallInst>(U));
+    }
+
+    for (CallInst *CI : eagerCallSites) {
+      Function *caller = CI->getFunction();
+      IRBuilder<> builder(&*caller->getEntryBlock().getFirstInsertionPt());
+      AllocaInst *thunkAlloca = builder.CreateAlloca(
+          thunkStructType, nullptr, "_wyvern_forced_thunk_alloca");
+      alignThunkAlloca(*thunkAlloca);
+      Value *thunkHeader = builder.CreateStructGEP(
+          thunkStructType, thunkAlloca, 0, "_wyvern_forced_thunk");
+
+      builder.SetInsertPoint(CI);
+      ConstantInt *thunkSize = builder.getInt64(
+          M.getDataLayout()
+              .getTypeAllocSize(thunkStructType)
+              .getFixedSize());
+      builder.CreateLifetimeStart(thunkAlloca, thunkSize);
+      Value *value = CI->getArgOperand(index);
+      builder.CreateStore(forcedDelegate,
+                          builder.CreateStructGEP(thunkHeaderType, thunkHeader,
+                                                  0, "_wyvern_thunk_fptr_gep"));
+      if (memo) {
+        builder.CreateStore(
+            value, builder.CreateStructGEP(thunkHeaderType, thunkHeader, 1,
+                                           "_wyvern_thunk_memo_val_gep"));
+      } else {
+        builder.CreateStore(
+            value, builder.CreateStructGEP(thunkStructType, thunkAlloca, 1,
+                                           "_wyvern_thunk_val_gep"));
+      }
+
+      CI->setCalledFunction(clone);
+      CI->setCallingConv(clone->getCallingConv());
+      CI->setArgOperand(index, thunkHeader);
+      // The callee now reads the caller's stack.
+      CI->setTailCall(false);
+      dropMemoryAttrs(*CI);
+      removeAttributesFromThunkArgument(*CI, index);
+      builder.SetInsertPoint(CI->getNextNode());
+      builder.CreateLifetimeEnd(thunkAlloca, thunkSize);
+      ++NumCallsitesPreForced;
+    }
+    if (callee->use_empty()) {
+      ++NumCalleesUnified;
+    }
+  }
+}
+
+void WyvernLazyficationPass::rewriteScalarCallSites() {
+  for (ScalarCallSite &site : scalarCallSites) {
+    CallInst *CI = site.CallSite;
+    AttributeList attrs = CI->getAttributes();
+    SmallVector<Value *> args;
+    SmallVector<AttributeSet> paramAttrs;
+    for (unsigned argIdx = 0; argIdx < CI->arg_size(); ++argIdx) {
+      if (argIdx != site.Index) {
+        args.push_back(CI->getArgOperand(argIdx));
+        paramAttrs.push_back(attrs.getParamAttrs(argIdx));
+        continue;
+      }
+      for (Value *envValue : site.Environment) {
+        args.push_back(envValue);
+        paramAttrs.push_back(AttributeSet());
+      }
+    }
+
+    SmallVector<OperandBundleDef> bundles;
+    CI->getOperandBundlesAsDefs(bundles);
+    CallInst *newCI = CallInst::Create(site.Clone, args, bundles, "", CI);
+    newCI->setAttributes(AttributeList::get(CI->getContext(),
+                                            attrs.getFnAttrs(),
+                                            attrs.getRetAttrs(), paramAttrs));
+    dropMemoryAttrs(*newCI);
+    newCI->setCallingConv(site.Clone->getCallingConv());
+    newCI->setTailCallKind(CI->getTailCallKind());
+    newCI->setDebugLoc(CI->getDebugLoc());
+    newCI->takeName(CI);
+    CI->replaceAllUsesWith(newCI);
+    profileInfo.erase(CI);
+    CI->eraseFromParent();
+  }
+  scalarCallSites.clear();
+}
+
+void WyvernLazyficationPass::removeReplacedCallees() {
+  std::set<Function *> callees;
+  for (auto &entry : clonedCallees) {
+    callees.insert(std::get<0>(entry.first));
+  }
+
+  for (Function *callee : callees) {
+    callee->removeDeadConstantUsers();
+    if (!callee->hasLocalLinkage() || !callee->use_empty()) {
+      continue;
+    }
+    LLVM_DEBUG(dbgs() << "Removing " << callee->getName()
+                      << ", all of its call sites were lazified\n");
+    for (auto it = clonedCallees.begin(); it != clonedCallees.end();) {
+      it = std::get<0>(it->first) == callee ? clonedCallees.erase(it)
+                                            : std::next(it);
+    }
+    slicingContexts.erase(callee);
+    callee->eraseFromParent();
+    ++NumCalleesRemoved;
+  }
+}
+
+bool WyvernLazyficationPass::runOnModule(Module &M) {
+  if (!WyvernLazyfication) {
+    return false;
+  }
+
+  LazyfiableInfo &FLA =
+      getAnalysis<FindLazyfiableWrapperPass>().getLazyfiableInfo();
+  GetAA = [this](Function &F) -> AAResults & {
+    return getAnalysis<AAResultsWrapperPass>(F).getAAResults();
+  };
+  GetTLI = [this](Function &F) -> TargetLibraryInfo & {
+    return getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(F);
+  };
+  std::map<Function *, std::unique_ptr<OptimizationRemarkEmitter>> emitters;
+  GetORE = [&emitters](Function &F) -> OptimizationRemarkEmitter & {
+    std::unique_ptr<OptimizationRemarkEmitter> &ORE = emitters[&F];
+    if (!ORE) {
+      ORE = std::make_unique<OptimizationRemarkEmitter>(&F);
+    }
+    return *ORE;
+  };
+
+  return lazifyModule(M, FLA);
+}
+
+/// Returns whether module @param M holds callees imported by a ThinLTO
+/// backend with recorded promising arguments. Modules only record them on
+/// their own definitions, so available_externally ones were imported.
+static bool hasImportedPromisingCallees(Module &M) {
+  return any_of(M, [](Function &F) {
+    return F.hasAvailableExternallyLinkage() &&
+           F.getMetadata(PromisingArgsMetadataName);
+  });
+}
+
+PreservedAnalyses LazyficationPass::run(Module &M,
+                                        ModuleAnalysisManager &MAM) {
+  if (!WyvernLazyfication ||
+      (importedCalleesOnly && !hasImportedPromisingCallees(M))) {
+    return PreservedAnalyses::all();
+  }
+
+  // Canonicalization invalidates whatever it changes on its own, so the
+  // analyses below are computed on the final form of the IR.
+  runRequiredPasses(M, MAM);
+
+  LazyfiableInfo &FLA = MAM.getResult<FindLazyfiableAnalysis>(M);
+  FunctionAnalysisManager &FAM =
+      MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+  WyvernLazyficationPass lazyfier(wholeProgram, importedCalleesOnly);
+  lazyfier.GetAA = [&FAM](Function &F) -> AAResults & {
+    return FAM.getResult<AAManager>(F);
+  };
+  lazyfier.GetTLI = [&FAM](Function &F) -> TargetLibraryInfo & {
+    return FAM.getResult<TargetLibraryAnalysis>(F);
+  };
+  lazyfier.GetORE = [&FAM](Function &F) -> OptimizationRemarkEmitter & {
+    return FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+  };
+
+  if (!lazyfier.lazifyModule(M, FLA)) {
+    return PreservedAnalyses::all();
+  }
+  return PreservedAnalyses::none();
+}
+
 void WyvernLazyficationPass::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addRequired<AssumptionCacheTracker>();
-  AU.addRequired<FindLazyfiableAnalysis>();
+  AU.addRequired<FindLazyfiableWrapperPass>();
   AU.addRequired<TargetLibraryInfoWrapperPass>();
   AU.addRequired<LoopInfoWrapperPass>();
   AU.addRequired<CallGraphWrapperPass>();
@@ -582,7 +1712,7 @@ static llvm::RegisterStandardPasses RegisterWyvernLazificationLTO(
     llvm::PassManagerBuilder::EP_FullLinkTimeOptimizationEarly,
     [](const llvm::PassManagerBuilder &Builder,
        llvm::legacy::PassManagerBase &PM) {
-      PM.add(new WyvernLazyficationPass());
+      PM.add(new WyvernLazyficationPass(/*wholeProgram=*/true));
       // Since we explicitly run LCSSA during our analyses, there may be
       // leftover invalid PHINodes created by it in the program. We must then
       // run -inst-combine explicitly to remove them (as LLVM itself does behind
@@ -1,11 +1,17 @@
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/SmallVector.h"
 
+#include <chrono>
+#include <functional>
 #include <set>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 namespace llvm {
 
+class OptimizationRemarkEmitter;
+
 /// Struct that represents a given instance of profiling information. For each
 /// call site, the profile info gives us the number of times the call site was
 /// called, the number of times each argument was uniquely evaluated at least
@@ -24,7 +30,41 @@ struct WyvernCallSiteProfInfo {
 
 struct WyvernLazyficationPass : public ModulePass {
   static char ID;
-  WyvernLazyficationPass() : ModulePass(ID) {}
+  WyvernLazyficationPass(bool wholeProgram = false,
+                         bool importedCalleesOnly = false)
+      : ModulePass(ID), wholeProgram(wholeProgram),
+        importedCalleesOnly(importedCalleesOnly) {}
+
+  /// Whether the whole program is visible to the pass, as in full LTO. In that
+  /// case, generated functions are internal, since there are no copies in
+  /// other modules to fold them with.
+  bool wholeProgram;
+
+  /// Whether only call sites to callees imported from other modules, which
+  /// are available_externally, are lazified, as in ThinLTO backends, where the
+  /// module's own call sites were lazified when it was compiled.
+  bool importedCalleesOnly;
+
+  /// Returns whether call sites to @param callee may be lazified.
+  bool isCandidateCallee(const Function *callee) const;
+
+  /// Returns whether identical generated functions should be folded with
+  /// their copies in other modules, rather than made internal.
+  bool foldAcrossModules() const;
+
+  /// Removes the internal callees whose call sites were all redirected to
+  /// their clones.
+  void removeReplacedCallees();
+
+  /// Redirects the call sites that were not lazified of internal callees
+  /// that have a shared clone to that clone, passing pre-forced thunks, so the
+  /// original callees can be removed.
+  void unifyCallees(Module &M);
+
+  /// Delegates of pre-forced thunks, by thunk type.
+  std::map<StructType *, Function *> forcedThunkDelegates;
+  Function *getForcedThunkDelegate(StructType *thunkStructType, bool memo,
+                                   Module &M);
 
   /// Lazifies the function call @param CI in terms of its actual parameter of
   /// index @param index. To do so, the instructions involved in computing the
@@ -32,10 +72,36 @@ struct WyvernLazyficationPass : public ModulePass {
   /// generated through program slicing.
   bool lazifyCallsite(CallInst &CI, uint8_t index, Module &M, AAResults *AA);
 
+  /// Lazifies argument @param index of call @param CI through a thunk holding
+  /// the environment of @param slice, and returns its delegate. If
+  /// @param specialize, the callee clone calls the delegate directly. With
+  /// @param memo, the thunk is memoized.
+  Function *lazifyCallsiteWithThunk(CallInst &CI, uint8_t index,
+                                    ProgramSlice &slice, bool specialize,
+                                    bool memo, Module &M);
+
+  /// Call site lazified without a thunk, which passes the environment of
+  /// the lazified argument of index Index to callee clone Clone.
+  struct ScalarCallSite {
+    CallInst *CallSite;
+    unsigned Index;
+    Function *Clone;
+    SmallVector<Value *> Environment;
+  };
+
+  /// Call sites lazified without a thunk, whose call instructions are only
+  /// replaced by rewriteScalarCallSites, once all call sites are lazified.
+  std::vector<ScalarCallSite> scalarCallSites;
+  void rewriteScalarCallSites();
+
   /// Returns whether a call site + param pair should be lazified, taking into
   /// account the input profiling information.
   bool shouldLazifyCallsitePGO(CallInst *CI, uint8_t argIdx);
 
+  /// Returns the fraction of the calls in @param CI where argument
+  /// @param argIdx was evaluated, according to the profiling information.
+  Optional<double> getProfileEvalRate(CallInst *CI, uint8_t argIdx);
+
   /// Loads profile information from the input profiling report file.
   bool loadProfileInfo(Module &M, std::string path);
 
@@ -46,11 +112,85 @@ struct WyvernLazyficationPass : public ModulePass {
   std::unordered_map<CallBase *, std::unique_ptr<WyvernCallSiteProfInfo>>
       profileInfo;
 
-  /// Caches the previously cloned callee functions, to be reused if possible.
-  std::map<std::tuple<Function *, unsigned, StructType *>, Function *>
+  /// Stores the slicing context of each caller function, shared by the slices
+  /// of all of its call sites. Contexts for callers with candidate call sites
+  /// are computed beforehand and in parallel.
+  std::map<Function *, std::unique_ptr<SlicingContext>> slicingContexts;
+
+  /// Computes the slicing contexts of the functions in @param criteria
+  /// concurrently, along with the slices of their candidate arguments.
+  void precomputeSlicingContexts(
+      const std::map<Function *, SmallVector<Instruction *>> &criteria);
+
+  /// Returns the slicing context of function @param F, computing it if needed.
+  SlicingContext &getSlicingContext(Function &F);
+
+  /// Returns whether argument @param index of candidate call site @param CI
+  /// may still be analyzed within the compile-time budgets, counting it as one
+  /// of its caller's candidates. Skipped call sites are reported in statistics
+  /// and remarks.
+  bool isWithinBudget(CallInst &CI, uint8_t index);
+
+  /// Number of candidate call sites analyzed per caller function.
+  std::map<Function *, unsigned> numCandidates;
+
+  /// Time after which no more call sites are analyzed, if there is a
+  /// compile-time budget.
+  std::chrono::steady_clock::time_point deadline;
+
+  /// Structural hashes of the caller functions, computed before they are
+  /// changed, that key their entries in the analysis cache.
+  std::map<Function *, std::string> functionHashes;
+
+  /// Caller functions changed by lazification, whose canOutline verdicts are
+  /// no longer looked up in or stored to the analysis cache.
+  std::set<Function *> modifiedCallers;
+
+  /// Whether each callee parameter is forced at most once by its callee, as
+  /// computed by isCalleeForcedAtMostOnce.
+  std::map<std::pair<Function *, unsigned>, bool> forcedAtMostOnce;
+
+  /// Returns whether every call to @param callee forces its parameter of index
+  /// @param index at most once, computing it only once per callee parameter.
+  bool isCalleeForcedAtMostOnce(Function &callee, unsigned index);
+
+  /// Number of candidate call sites for each callee parameter.
+  std::map<std::pair<Function *, unsigned>, unsigned> numCandidateSites;
+
+  /// Caches the previously cloned callee functions, to be reused if possible,
+  /// keyed by callee, parameter index, the delegate the clone is
+  /// specialized for (null for clones shared by all delegates) and whether it
+  /// takes memoized thunks.
+  std::map<std::tuple<Function *, unsigned, Function *, bool>, Function *>
       clonedCallees;
 
+  /// Providers for the per-function analyses used by lazification. They are
+  /// set by whichever pass manager is driving the transformation.
+  std::function<AAResults &(Function &)> GetAA;
+  std::function<TargetLibraryInfo &(Function &)> GetTLI;
+  std::function<OptimizationRemarkEmitter &(Function &)> GetORE;
+
+  /// Lazifies the call sites of module @param M deemed optimizable, either by
+  /// the results of the lazifiable analysis in @param FLI or by the input
+  /// profiling information. Returns whether the module was changed.
+  bool lazifyModule(Module &M, LazyfiableInfo &FLI);
+
   bool runOnModule(Module &);
   void getAnalysisUsage(AnalysisUsage &) const;
 };
+
+/// New pass manager version of the lazification pass.
+struct LazyficationPass : public PassInfoMixin<LazyficationPass> {
+  LazyficationPass(bool wholeProgram = false, bool importedCalleesOnly = false)
+      : wholeProgram(wholeProgram), importedCalleesOnly(importedCalleesOnly) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+
+  /// Whether the whole program is visible to the pass, as in full LTO.
+  bool wholeProgram;
+
+  /// Whether only call sites to imported callees are lazified, as in ThinLTO
+  /// backends.
+  bool importedCalleesOnly;
+};
 } // namespace llvm
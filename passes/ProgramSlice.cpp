@@ -1,6 +1,9 @@
 #include "ProgramSlice.h"
 #include "DebugUtils.h"
+#include "StructuralHash.h"
 
+#include <algorithm>
+#include <limits>
 #include <map>
 #include <queue>
 #include <set>
@@ -9,11 +12,12 @@
 #include <unordered_map>
 #include <utility>
 
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/Statistic.h"
-#include "llvm/Analysis/AliasSetTracker.h"
 #include "llvm/Analysis/CaptureTracking.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/MemorySSA.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
@@ -26,15 +30,29 @@
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 
-#include <random>
 
 #define DEBUG_TYPE "ProgramSlicing"
 
 using namespace llvm;
 
+static cl::opt<unsigned> WyvernCaptureMinSize(
+    "wylazy-capture-min-size", cl::init(2),
+    cl::desc("Wyvern - Minimum size of the backward slice of a value that the "
+             "caller computes anyway for it to be captured in the thunk "
+             "environment rather than recomputed by the delegate (0 disables "
+             "capturing)."));
+
+static cl::opt<unsigned> WyvernMaxEagerValues(
+    "wylazy-max-eager-values", cl::init(4),
+    cl::desc("Wyvern - Maximum number of instructions that keep a slice from "
+             "being outlined to compute eagerly, so the rest of the slice can "
+             "be outlined (0 only outlines whole slices)."));
+
 /// Returns the block whose predicate should control the phi-functions in BB
 static const BasicBlock *getController(const BasicBlock *BB, DominatorTree &DT,
                                        PostDominatorTree &PDT) {
@@ -71,12 +89,9 @@ static const Value *getGate(const BasicBlock *BB) {
 /// Computes the gates for all basic blocks in the slice. The data structure
 /// holding the gates data is a map of each basic block to a vector of its
 /// gates.
-static const std::unordered_map<const BasicBlock *, SmallVector<const Value *>>
-computeGates(Function &F) {
-  std::unordered_map<const BasicBlock *, SmallVector<const Value *>> gates;
-  DominatorTree DT(F);
-  PostDominatorTree PDT;
-  PDT.recalculate(F);
+static GatesMap computeGates(Function &F, DominatorTree &DT,
+                             PostDominatorTree &PDT) {
+  GatesMap gates;
   for (const BasicBlock &BB : F) {
     SmallVector<const Value *> BB_gates;
     const unsigned num_preds = pred_size(&BB);
@@ -104,126 +119,437 @@ computeGates(Function &F) {
   return gates;
 }
 
-/// Computes the backwards data dependences for the given instruction, to
-/// compute which instructions should be part of the slice. Using the
-/// phi-function gate information contained in gates, control dependencies can
-/// also be tracked as data dependences. Thus, this function is enough to
-/// compute all dependencies necessary to building a slice.
-static std::tuple<std::set<const BasicBlock *>, std::set<const Value *>>
-get_data_dependences_for(
-    Instruction &I,
-    std::unordered_map<const BasicBlock *, SmallVector<const Value *>> &gates) {
-  std::set<const Value *> deps;
-  std::set<const BasicBlock *> BBs;
-  std::set<const Value *> visited;
-  std::queue<const Value *> to_visit;
-
-  to_visit.push(&I);
-  deps.insert(&I);
-  while (!to_visit.empty()) {
-    const Value *cur = to_visit.front();
-    deps.insert(cur);
-    to_visit.pop();
-
-    if (const Instruction *dep = dyn_cast<Instruction>(cur)) {
-      BBs.insert(dep->getParent());
-      for (const Use &U : dep->operands()) {
-        if ((!isa<Instruction>(U) && !isa<Argument>(U)) || visited.count(U)) {
-          continue;
+SlicingContext::SlicingContext(Function &F) : _F(F), _DT(F), _PDT(F) {
+  _LI.analyze(_DT);
+  _gates = computeGates(F, _DT, _PDT);
+
+  for (BasicBlock &BB : F) {
+    _blockNumbers[&BB] = _blocks.size();
+    _blocks.push_back(&BB);
+    for (Instruction &I : BB) {
+      _instNumbers[&I] = _insts.size();
+      _insts.push_back(&I);
+    }
+  }
+
+  _pdg.resize(_insts.size());
+  for (unsigned N = 0, E = _insts.size(); N < E; ++N) {
+    buildDependenceNode(N);
+  }
+}
+
+unsigned SlicingContext::getNumber(const BasicBlock *BB) const {
+  auto it = _blockNumbers.find(BB);
+  assert(it != _blockNumbers.end() && "Block from a different function!");
+  return it->second;
+}
+
+unsigned SlicingContext::getNumber(const Instruction *I) {
+  auto [it, inserted] = _instNumbers.try_emplace(I, _insts.size());
+  unsigned N = it->second;
+  if (inserted) {
+    assert(I->getFunction() == &_F && "Instruction from a different function!");
+    _insts.push_back(const_cast<Instruction *>(I));
+    _pdg.emplace_back();
+    buildDependenceNode(N);
+  }
+  return N;
+}
+
+/// Computes the dependences of instruction number @param N. Using the
+/// phi-function gates, control dependences are also tracked as data
+/// dependences, so these edges are enough to compute the slices.
+void SlicingContext::buildDependenceNode(unsigned N) {
+  const Instruction *I = _insts[N];
+  DependenceNode node;
+
+  // Numbering an operand inserted after the context was built recursively
+  // builds its node, which may grow the graph, so the node is built apart.
+  auto addDependence = [&](const Value *V) {
+    if (const Argument *A = dyn_cast<Argument>(V)) {
+      node.Args.push_back(A->getArgNo());
+    } else if (const Instruction *dep = dyn_cast<Instruction>(V)) {
+      node.Insts.push_back(getNumber(dep));
+    }
+  };
+
+  node.Blocks.push_back(getNumber(I->getParent()));
+  for (const Use &U : I->operands()) {
+    addDependence(U);
+  }
+
+  if (const PHINode *PN = dyn_cast<PHINode>(I)) {
+    for (const BasicBlock *BB : PN->blocks()) {
+      node.Blocks.push_back(getNumber(BB));
+    }
+    auto gatesIt = _gates.find(PN->getParent());
+    if (gatesIt != _gates.end()) {
+      for (const Value *gate : gatesIt->second) {
+        if (gate) {
+          addDependence(gate);
         }
-        visited.insert(U);
-        to_visit.push(U);
       }
     }
+  }
+
+  _pdg[N] = std::move(node);
+}
+
+void SlicingContext::updateDependences(ArrayRef<Instruction *> changed) {
+  for (Instruction *I : changed) {
+    buildDependenceNode(getNumber(I));
+  }
+  _slices.clear();
+}
+
+const SliceDependences &SlicingContext::getSlice(Instruction *I) {
+  auto it = _slices.find(I);
+  if (it == _slices.end()) {
+    computeSlices({I});
+    it = _slices.find(I);
+  }
+  return *it->second;
+}
 
-    if (const PHINode *PN = dyn_cast<PHINode>(cur)) {
-      for (const BasicBlock *BB : PN->blocks()) {
-        BBs.insert(BB);
+/// Slices are computed on the condensation of the dependence graph (its
+/// strongly connected components, found with Tarjan's algorithm), which is
+/// acyclic. Each criterion is assigned a bit, and bit masks are propagated from
+/// users to their dependences in topological order, so each node reachable
+/// from any criterion is visited once per 64 criteria.
+void SlicingContext::computeSlices(ArrayRef<Instruction *> criteria) {
+  SmallVector<Instruction *> roots;
+  for (Instruction *I : criteria) {
+    if (!_slices.count(I) && !is_contained(roots, I)) {
+      getNumber(I);
+      roots.push_back(I);
+    }
+  }
+  if (roots.empty()) {
+    return;
+  }
+
+  const unsigned numInsts = _insts.size();
+  const unsigned unvisited = std::numeric_limits<unsigned>::max();
+  std::vector<unsigned> index(numInsts, unvisited);
+  std::vector<unsigned> lowlink(numInsts);
+  std::vector<unsigned> sccOf(numInsts, unvisited);
+  BitVector onStack(numInsts);
+  SmallVector<unsigned> stack;
+  SmallVector<std::pair<unsigned, unsigned>> callStack;
+  // SCC members, in the order SCCs are found: dependences before their users.
+  SmallVector<unsigned> sccMembers;
+  SmallVector<unsigned> sccBegin;
+  unsigned nextIndex = 0;
+
+  for (Instruction *root : roots) {
+    unsigned rootN = _instNumbers[root];
+    if (index[rootN] != unvisited) {
+      continue;
+    }
+    index[rootN] = lowlink[rootN] = nextIndex++;
+    stack.push_back(rootN);
+    onStack.set(rootN);
+    callStack.push_back({rootN, 0});
+
+    while (!callStack.empty()) {
+      unsigned v = callStack.back().first;
+      unsigned &edge = callStack.back().second;
+      if (edge < _pdg[v].Insts.size()) {
+        unsigned w = _pdg[v].Insts[edge++];
+        if (index[w] == unvisited) {
+          index[w] = lowlink[w] = nextIndex++;
+          stack.push_back(w);
+          onStack.set(w);
+          callStack.push_back({w, 0});
+        } else if (onStack.test(w)) {
+          lowlink[v] = std::min(lowlink[v], index[w]);
+        }
+        continue;
+      }
+
+      callStack.pop_back();
+      if (!callStack.empty()) {
+        unsigned parent = callStack.back().first;
+        lowlink[parent] = std::min(lowlink[parent], lowlink[v]);
+      }
+      if (lowlink[v] != index[v]) {
+        continue;
+      }
+      unsigned scc = sccBegin.size();
+      sccBegin.push_back(sccMembers.size());
+      unsigned w;
+      do {
+        w = stack.pop_back_val();
+        onStack.reset(w);
+        sccOf[w] = scc;
+        sccMembers.push_back(w);
+      } while (w != v);
+    }
+  }
+  const unsigned numSCCs = sccBegin.size();
+  sccBegin.push_back(sccMembers.size());
+
+  for (unsigned base = 0; base < roots.size(); base += 64) {
+    unsigned count = std::min<unsigned>(64, roots.size() - base);
+    std::vector<uint64_t> masks(numSCCs, 0);
+    SmallVector<std::unique_ptr<SliceDependences>> results;
+    for (unsigned i = 0; i < count; ++i) {
+      masks[sccOf[_instNumbers[roots[base + i]]]] |= uint64_t(1) << i;
+      results.push_back(std::make_unique<SliceDependences>(SliceDependences{
+          BitVector(numInsts), BitVector(_blocks.size()),
+          BitVector(_F.arg_size())}));
+    }
+
+    // Users are found after their dependences, so visiting the components
+    // backwards reaches every component after all of its users.
+    for (unsigned scc = numSCCs; scc-- > 0;) {
+      uint64_t mask = masks[scc];
+      if (!mask) {
+        continue;
       }
-      for (const Value *gate : gates[PN->getParent()]) {
-        if (gate && !visited.count(gate)) {
-          to_visit.push(gate);
+      for (unsigned m = sccBegin[scc]; m < sccBegin[scc + 1]; ++m) {
+        const DependenceNode &node = _pdg[sccMembers[m]];
+        for (unsigned dep : node.Insts) {
+          masks[sccOf[dep]] |= mask;
+        }
+        for (uint64_t bits = mask; bits; bits &= bits - 1) {
+          SliceDependences &slice = *results[countTrailingZeros(bits)];
+          slice.Insts.set(sccMembers[m]);
+          for (unsigned BBN : node.Blocks) {
+            slice.Blocks.set(BBN);
+          }
+          for (unsigned argNo : node.Args) {
+            slice.Args.set(argNo);
+          }
         }
       }
     }
+
+    for (unsigned i = 0; i < count; ++i) {
+      _slices[roots[base + i]] = std::move(results[i]);
+    }
   }
+}
+
+SliceDependences
+SlicingContext::getSliceWithCut(Instruction *I,
+                                function_ref<bool(Instruction *)> isCaptured,
+                                SmallVectorImpl<Instruction *> &captured) {
+  unsigned rootN = getNumber(I);
+  SliceDependences slice{BitVector(_insts.size()), BitVector(_blocks.size()),
+                         BitVector(_F.arg_size())};
+  BitVector visited(_insts.size());
+  SmallVector<unsigned> worklist = {rootN};
+  visited.set(rootN);
+
+  while (!worklist.empty()) {
+    unsigned N = worklist.pop_back_val();
+    const DependenceNode &node = _pdg[N];
+    for (unsigned BBN : node.Blocks) {
+      slice.Blocks.set(BBN);
+    }
+    if (N != rootN && isCaptured(_insts[N])) {
+      captured.push_back(_insts[N]);
+      continue;
+    }
 
-  return std::make_tuple(BBs, deps);
+    slice.Insts.set(N);
+    for (unsigned argNo : node.Args) {
+      slice.Args.set(argNo);
+    }
+    for (unsigned dep : node.Insts) {
+      if (!visited.test(dep)) {
+        visited.set(dep);
+        worklist.push_back(dep);
+      }
+    }
+  }
+  return slice;
+}
+
+unsigned SlicingContext::countDependences(Instruction *I, unsigned limit) {
+  unsigned rootN = getNumber(I);
+  BitVector visited(_insts.size());
+  SmallVector<unsigned> worklist = {rootN};
+  visited.set(rootN);
+  unsigned count = 0;
+
+  while (!worklist.empty() && count < limit) {
+    unsigned N = worklist.pop_back_val();
+    ++count;
+    for (unsigned dep : _pdg[N].Insts) {
+      if (!visited.test(dep)) {
+        visited.set(dep);
+        worklist.push_back(dep);
+      }
+    }
+  }
+  return count;
+}
+
+MemorySSA &SlicingContext::getMemorySSA(AAResults &AA) {
+  if (!_MSSA) {
+    _MSSA = std::make_unique<MemorySSA>(_F, &AA, &_DT);
+  }
+  return *_MSSA;
 }
 
 ProgramSlice::ProgramSlice(Instruction &Initial, Function &F,
-                           CallInst &CallSite, AAResults *AA,
-                           TargetLibraryInfo &TLI, bool thunkDebugging)
+                           CallInst &CallSite, SlicingContext &context,
+                           AAResults *AA, TargetLibraryInfo &TLI,
+                           bool thunkDebugging)
     : _AA(AA), _TLI(TLI), _initial(&Initial), _parentFunction(&F),
-      _thunkDebugging(thunkDebugging) {
+      _context(context), _thunkDebugging(thunkDebugging) {
   assert(Initial.getParent()->getParent() == &F &&
          "Slicing instruction from different function!");
+  assert(&context.getFunction() == &F &&
+         "Slicing context describes a different function!");
+  WyvernStageTimer timer("slice", "Compute slices", F.getName());
 
-  std::unordered_map<const BasicBlock *, SmallVector<const Value *>> gates =
-      computeGates(F);
-  auto [BBsInSlice, valuesInSlice] = get_data_dependences_for(Initial, gates);
-  std::set<const Instruction *> instsInSlice;
-  SmallVector<Argument *> depArgs;
+  _CallSite = &CallSite;
+  computeCut();
 
-  for (auto &val : valuesInSlice) {
-    if (Argument *A = dyn_cast<Argument>(const_cast<Value *>(val))) {
-      depArgs.push_back(A);
-    } else if (const Instruction *I = dyn_cast<Instruction>(val)) {
-      instsInSlice.insert(I);
-    }
-  }
+  LLVM_DEBUG(printSlice());
+}
 
-  _instsInSlice = instsInSlice;
-  _depArgs = depArgs;
-  _BBsInSlice = BBsInSlice;
-  _CallSite = &CallSite;
+/// Computes the instructions and blocks in the slice, and its environment.
+/// Values that the parent function computes anyway, and the instructions
+/// computed eagerly, are captured in the environment, cutting the slice there,
+/// so the delegate only recomputes the rest. The cut is taken as close to the
+/// criterion as possible.
+void ProgramSlice::computeCut() {
+  const SliceDependences &deps = _context.getSlice(_initial);
+  SmallVector<Instruction *> captured;
+  SliceDependences cut = _context.getSliceWithCut(
+      _initial,
+      [&](Instruction *I) {
+        return is_contained(_eagerValues, I) || shouldCapture(I, deps);
+      },
+      captured);
+  _instsInSlice = std::move(cut.Insts);
+  _BBsInSlice = std::move(cut.Blocks);
+  _environment.clear();
+  for (unsigned argNo : cut.Args.set_bits()) {
+    _environment.push_back(_parentFunction->getArg(argNo));
+  }
+  sort(captured, [this](const Instruction *A, const Instruction *B) {
+    return _context.getNumber(A) < _context.getNumber(B);
+  });
+  _environment.append(captured.begin(), captured.end());
+
+  // Lay out the environment by decreasing alignment, which minimizes the
+  // padding between its fields. The sort is stable, so the layout does not
+  // depend on anything but the types and order of the values.
+  const DataLayout &DL = _parentFunction->getParent()->getDataLayout();
+  std::stable_sort(_environment.begin(), _environment.end(),
+                   [&DL](const Value *A, const Value *B) {
+                     return DL.getABITypeAlign(A->getType()) >
+                            DL.getABITypeAlign(B->getType());
+                   });
 
-  // We need to pre-compute struct types, because if we build it everytime
-  // it's needed, LLVM creates multiple types with the same structure but
-  // different names.
   _thunkStructType = computeStructType(false /*memo*/);
   _memoizedThunkStructType = computeStructType(true /*memo*/);
 
   computeAttractorBlocks();
+}
 
-  LLVM_DEBUG(printSlice());
+/// Returns whether instruction @param I, from the slice, can be captured in
+/// the environment. Captured values must dominate the criterion, so they hold
+/// the values the criterion was computed from wherever the thunk is
+/// initialized.
+bool ProgramSlice::canCapture(const Instruction *I) {
+  return I != _initial && !isa<AllocaInst>(I) && I->getType()->isSized() &&
+         _context.getDomTree().dominates(I, _initial);
+}
+
+/// Returns whether instruction @param I, in the backward slice @param deps of
+/// the criterion, should be captured in the environment rather than sliced.
+/// Captured values must already be computed by the parent function for some
+/// other use. Values whose own slice is smaller than -wylazy-capture-min-size
+/// cost less to recompute than to store in the thunk.
+bool ProgramSlice::shouldCapture(Instruction *I, const SliceDependences &deps) {
+  if (WyvernCaptureMinSize == 0 || !canCapture(I)) {
+    return false;
+  }
+
+  bool computedAnyway = any_of(I->users(), [&](const User *U) {
+    const Instruction *UserI = dyn_cast<Instruction>(U);
+    if (!UserI || UserI->getFunction() != _parentFunction) {
+      return false;
+    }
+    unsigned N = _context.getNumber(UserI);
+    return N >= deps.Insts.size() || !deps.Insts.test(N);
+  });
+  return computedAnyway &&
+         _context.countDependences(I, WyvernCaptureMinSize) >=
+             WyvernCaptureMinSize;
+}
+
+/// Returns whether instruction @param I, from the parent function, is in the
+/// slice.
+bool ProgramSlice::isInSlice(const Instruction *I) {
+  unsigned N = _context.getNumber(I);
+  return N < _instsInSlice.size() && _instsInSlice.test(N);
+}
+
+/// Returns whether block @param BB, from the parent function, is in the
+/// slice.
+bool ProgramSlice::isInSlice(const BasicBlock *BB) const {
+  return BB && _BBsInSlice.test(_context.getNumber(BB));
+}
+
+/// Returns the clone of block @param BB in the delegate function, or null if
+/// it was not cloned or is not a block from the parent function.
+BasicBlock *ProgramSlice::getClonedBlock(const BasicBlock *BB) const {
+  if (!BB || BB->getParent() != _parentFunction) {
+    return nullptr;
+  }
+  return _origToNewBBmap[_context.getNumber(BB)];
+}
+
+/// Returns the attractor of block @param BB, or null if it has none or is not
+/// a block from the parent function.
+const BasicBlock *ProgramSlice::getAttractor(const BasicBlock *BB) const {
+  if (BB->getParent() != _parentFunction) {
+    return nullptr;
+  }
+  return _attractors[_context.getNumber(BB)];
 }
 
 /// Computes the layout of the struct type that should be used to lazify
 /// instances of this delegate function.
-StructType *ProgramSlice::computeStructType(bool memo) {
-  Module *M = _initial->getParent()->getParent()->getParent();
-  LLVMContext &Ctx = M->getContext();
+StructType *llvm::getThunkHeaderType(Type *valueType, bool memo) {
+  LLVMContext &Ctx = valueType->getContext();
+  std::string name;
+  raw_string_ostream nameOs(name);
+  nameOs << (memo ? "_wyvern_thunk_memo_header." : "_wyvern_thunk_header.");
+  valueType->print(nameOs);
+
+  if (StructType *header = StructType::getTypeByName(Ctx, nameOs.str())) {
+    return header;
+  }
 
-  StructType *thunkStructType = StructType::create(Ctx);
-  PointerType *thunkStructPtrType = PointerType::get(thunkStructType, 0);
+  StructType *header = StructType::create(Ctx, nameOs.str());
   FunctionType *delegateFunctionType =
-      FunctionType::get(_initial->getType(), {thunkStructPtrType}, false);
-  SmallVector<Type *> thunkTypes;
+      FunctionType::get(valueType, {header->getPointerTo()}, false);
+  SmallVector<Type *> headerTypes = {delegateFunctionType->getPointerTo()};
   if (memo) {
-    // Memoized thunks have the form:
-    //   T (fptr)(struct thunk *thk);
-    //   T memo_val;
-    //   bool memo_flag;
-    //   ... (environment)
-    thunkTypes = {delegateFunctionType->getPointerTo(),
-                  delegateFunctionType->getReturnType(),
-                  IntegerType::get(Ctx, 1)};
-  } else {
-    // Non-memoized thunks have the form:
-    //  T (fptr)(struct thunk *thk);
-    //  ... (environment)
-    thunkTypes = {delegateFunctionType->getPointerTo()};
+    headerTypes.push_back(valueType);
   }
+  header->setBody(headerTypes);
+  return header;
+}
 
-  for (auto &arg : _depArgs) {
-    thunkTypes.push_back(arg->getType());
+StructType *ProgramSlice::computeStructType(bool memo) {
+  // Thunks have the form:
+  //   header (see getThunkHeaderType)
+  //   ... (environment)
+  SmallVector<Type *> thunkTypes = {
+      getThunkHeaderType(_initial->getType(), memo)};
+  for (Value *V : _environment) {
+    thunkTypes.push_back(V->getType());
   }
-
-  thunkStructType->setBody(thunkTypes);
-  thunkStructType->setName("_wyvern_thunk_type");
-
-  return thunkStructType;
+  return StructType::get(_initial->getContext(), thunkTypes);
 }
 
 StructType *ProgramSlice::getThunkStructType(bool memo) {
@@ -241,17 +567,18 @@ void ProgramSlice::printSlice() {
                     << " ====\n");
   LLVM_DEBUG(dbgs() << "==== Call site: " << *_CallSite << " ====\n");
   LLVM_DEBUG(dbgs() << "BBs in slice:\n");
-  for (const BasicBlock *BB : _BBsInSlice) {
+  for (unsigned BBN : _BBsInSlice.set_bits()) {
+    const BasicBlock *BB = _context.getBlock(BBN);
     LLVM_DEBUG(dbgs() << "\t" << BB->getName() << "\n");
     for (const Instruction &I : *BB) {
-      if (_instsInSlice.count(&I)) {
+      if (isInSlice(&I)) {
         LLVM_DEBUG(dbgs() << "\t\t" << I << "\n";);
       }
     }
   }
-  LLVM_DEBUG(dbgs() << "Arguments in slice:\n");
-  for (const Argument *A : _depArgs) {
-    LLVM_DEBUG(dbgs() << "\t" << *A << "\n";);
+  LLVM_DEBUG(dbgs() << "Environment of slice:\n");
+  for (const Value *V : _environment) {
+    LLVM_DEBUG(dbgs() << "\t" << *V << "\n";);
   }
   LLVM_DEBUG(dbgs() << "============= \n\n");
 }
@@ -267,55 +594,73 @@ void ProgramSlice::printFunctions(Function *F) {
 /// original function. The map of basic blocks to their attractors is used to
 /// reroute control flow in the outlined delegate function.
 void ProgramSlice::computeAttractorBlocks() {
-  PostDominatorTree PDT;
-  PDT.recalculate(*_parentFunction);
-  std::map<const BasicBlock *, const BasicBlock *> attractors;
+  PostDominatorTree &PDT = _context.getPostDomTree();
+  _attractors.assign(_context.getNumBlocks(), nullptr);
 
-  for (const BasicBlock &BB : *_parentFunction) {
-    if (attractors.count(&BB) > 0) {
+  for (unsigned N = 0, E = _context.getNumBlocks(); N < E; ++N) {
+    const BasicBlock *BB = _context.getBlock(N);
+    if (_BBsInSlice.test(N)) {
+      _attractors[N] = BB;
       continue;
     }
 
-    if (_BBsInSlice.count(&BB) > 0) {
-      attractors[&BB] = &BB;
-      continue;
-    }
-
-    DomTreeNode *OrigBB = PDT.getNode(&BB);
+    DomTreeNode *OrigBB = PDT.getNode(BB);
     DomTreeNode *Cand = OrigBB->getIDom();
     while (Cand != nullptr) {
-      if (_BBsInSlice.count(Cand->getBlock()) > 0) {
+      if (isInSlice(Cand->getBlock())) {
         break;
       }
       Cand = Cand->getIDom();
     }
     if (Cand) {
-      attractors[&BB] = Cand->getBlock();
+      _attractors[N] = Cand->getBlock();
     }
   }
-  _attractors = attractors;
 }
 
 /// Adds branches from immediate dominators which existed in the original
-/// function to the slice.
-void ProgramSlice::addDomBranches(DomTreeNode *cur, DomTreeNode *parent,
-                                  std::set<DomTreeNode *> &visited) {
-  if (_BBsInSlice.count(cur->getBlock())) {
-    parent = cur;
-  }
+/// function to the slice. The dominator tree is walked with an explicit stack,
+/// as it can be as deep as the function is long.
+void ProgramSlice::addDomBranches(DomTreeNode *root, DomTreeNode *parent,
+                                  BitVector &visited) {
+  struct Frame {
+    DomTreeNode *node;
+    // closest ancestor of node (or node itself) that is in the slice
+    DomTreeNode *parent;
+    unsigned nextChild;
+    // whether the walk has descended into the child at nextChild
+    bool descended;
+  };
+  SmallVector<Frame> stack = {
+      {root, isInSlice(root->getBlock()) ? root : parent, 0, false}};
+
+  while (!stack.empty()) {
+    Frame &frame = stack.back();
+    if (frame.nextChild == frame.node->getNumChildren()) {
+      stack.pop_back();
+      continue;
+    }
 
-  for (DomTreeNode *child : *cur) {
-    if (!visited.count(child)) {
-      visited.insert(child);
-      addDomBranches(child, parent, visited);
+    DomTreeNode *child = *(frame.node->begin() + frame.nextChild);
+    unsigned childN = _context.getNumber(child->getBlock());
+    if (!frame.descended && !visited.test(childN)) {
+      visited.set(childN);
+      frame.descended = true;
+      DomTreeNode *childParent = _BBsInSlice.test(childN) ? child : frame.parent;
+      stack.push_back({child, childParent, 0, false});
+      continue;
     }
-    if (_BBsInSlice.count(child->getBlock()) && parent) {
-      BasicBlock *parentBB = _origToNewBBmap[parent->getBlock()];
-      BasicBlock *childBB = _origToNewBBmap[child->getBlock()];
+
+    // The child's subtree has been visited, so link it to its parent.
+    if (_BBsInSlice.test(childN) && frame.parent) {
+      BasicBlock *parentBB = getClonedBlock(frame.parent->getBlock());
+      BasicBlock *childBB = _origToNewBBmap[childN];
       if (parentBB->getTerminator() == nullptr) {
-        BranchInst *newBranch = BranchInst::Create(childBB, parentBB);
+        BranchInst::Create(childBB, parentBB);
       }
     }
+    ++frame.nextChild;
+    frame.descended = false;
   }
 }
 
@@ -346,18 +691,18 @@ void updatePHINodes(Function *F) {
 /// delegate function, once instructions and basic blocks from the original
 /// function have been possibly removed.
 void ProgramSlice::rerouteBranches(Function *F) {
-  DominatorTree DT(*_parentFunction);
-  std::set<DomTreeNode *> visited;
+  DominatorTree &DT = _context.getDomTree();
+  BitVector visited(_context.getNumBlocks());
   DomTreeNode *parent = nullptr;
 
   DomTreeNode *init = DT.getRootNode();
-  visited.insert(init);
-  if (_BBsInSlice.count(init->getBlock())) {
+  visited.set(_context.getNumber(init->getBlock()));
+  if (isInSlice(init->getBlock())) {
     parent = init;
   }
 
-  // Visit blocks recursively in order of dominance. If BB1 and BB2 are in
-  // slice, BB1 IDom BB2, and BB1 has no terminator, create branch BB1->BB2
+  // Visit blocks in order of dominance. If BB1 and BB2 are in slice, BB1 IDom
+  // BB2, and BB1 has no terminator, create branch BB1->BB2
   addDomBranches(init, parent, visited);
 
   // Save list of PHI nodes to update. Old blocks should be replaced by
@@ -382,7 +727,7 @@ void ProgramSlice::rerouteBranches(Function *F) {
       if (const BranchInst *origBranch =
               dyn_cast<BranchInst>(parentBB->getTerminator())) {
         for (const BasicBlock *suc : origBranch->successors()) {
-          BasicBlock *newTarget = _origToNewBBmap[_attractors[suc]];
+          BasicBlock *newTarget = getClonedBlock(getAttractor(suc));
           if (!newTarget) {
             continue;
           }
@@ -423,8 +768,7 @@ void ProgramSlice::rerouteBranches(Function *F) {
           if (suc->getParent() == F) {
             continue;
           }
-          const BasicBlock *attractor = _attractors[suc];
-          BasicBlock *newSucc = _origToNewBBmap[attractor];
+          BasicBlock *newSucc = getClonedBlock(getAttractor(suc));
 
           if (!newSucc) {
             suc->replaceUsesWithIf(unreachableBlock, [F](Use &U) {
@@ -450,8 +794,7 @@ void ProgramSlice::rerouteBranches(Function *F) {
           if (suc->getParent() == F) {
             continue;
           }
-          const BasicBlock *attractor = _attractors[suc];
-          BasicBlock *newSucc = _origToNewBBmap[attractor];
+          BasicBlock *newSucc = getClonedBlock(getAttractor(suc));
 
           if (!newSucc) {
             suc->replaceUsesWithIf(unreachableBlock, [F](Use &U) {
@@ -484,85 +827,253 @@ void ProgramSlice::rerouteBranches(Function *F) {
   updatePHINodes(F);
 }
 
-bool ProgramSlice::canOutline() {
-  DominatorTree DT(*_parentFunction);
-  LoopInfo LI = LoopInfo(DT);
-  AliasSetTracker AST(*_AA);
+/// Maximum number of memory accesses visited when checking whether a load in
+/// the slice may be clobbered before the slice is forced. Beyond it, we
+/// conservatively assume it may.
+static const unsigned int ClobberWalkLimit = 1024;
+
+/// Returns the memory state (the reaching memory access) right before
+/// instruction @param P. Instructions without memory accesses, such as the
+/// ones inserted by lazification, are skipped.
+static MemoryAccess *getMemoryStateBefore(Instruction *P, MemorySSA &MSSA,
+                                          DominatorTree &DT) {
+  BasicBlock *BB = P->getParent();
+  for (auto it = ++P->getReverseIterator(); it != BB->rend(); ++it) {
+    if (MemoryUseOrDef *MA = MSSA.getMemoryAccess(&*it)) {
+      return isa<MemoryDef>(MA) ? MA : MA->getDefiningAccess();
+    }
+  }
 
-  // Build alias sets for memory instructions in the function.
-  for (BasicBlock &BB : *_parentFunction) {
-    for (Instruction &I : BB) {
-      if (StoreInst *SI = dyn_cast<StoreInst>(&I)) {
-        AST.add(SI);
-      } else if (CallBase *CB = dyn_cast<CallBase>(&I)) {
-        if (CB == _CallSite) {
-          continue;
+  if (MemoryPhi *Phi = MSSA.getMemoryAccess(BB)) {
+    return Phi;
+  }
+
+  // A block without a MemoryPhi is reached by a single memory state: the last
+  // definition in its closest dominator that has one.
+  for (DomTreeNode *N = DT.getNode(BB)->getIDom(); N; N = N->getIDom()) {
+    if (const MemorySSA::DefsList *defs = MSSA.getBlockDefs(N->getBlock())) {
+      return const_cast<MemoryAccess *>(&*defs->rbegin());
+    }
+  }
+  return MSSA.getLiveOnEntryDef();
+}
+
+/// Returns whether the memory read by load @param LI, a load in the slice, may
+/// be modified between the load's original position and forcing point
+/// @param P, where the slice will be evaluated instead. Modifications by
+/// @param CallSite itself are not considered, as in the rest of the safety
+/// checks.
+///
+/// We walk memory SSA backwards from @param P, stopping at the access that
+/// clobbers the load originally. If the load is in a loop that does not
+/// contain @param P, every iteration of that loop happens before @param P, so
+/// all of the loop's definitions are checked and the walk stops at the loop.
+static bool mayBeClobberedBeforeForcing(const LoadInst *LI, Instruction *P,
+                                        const CallInst *CallSite,
+                                        SlicingContext &context,
+                                        AAResults &AA) {
+  MemorySSA &MSSA = context.getMemorySSA(AA);
+  LoopInfo &LI_ = context.getLoopInfo();
+  MemoryLocation loc = MemoryLocation::get(LI);
+
+  auto clobbers = [&](const MemoryDef *def) {
+    Instruction *I = def->getMemoryInst();
+    return I != CallSite && isModSet(AA.getModRefInfo(I, loc));
+  };
+
+  Loop *loadLoop = LI_.getLoopFor(LI->getParent());
+  while (loadLoop && loadLoop->getParentLoop() &&
+         !loadLoop->getParentLoop()->contains(P)) {
+    loadLoop = loadLoop->getParentLoop();
+  }
+  if (loadLoop && loadLoop->contains(P)) {
+    loadLoop = nullptr;
+  }
+
+  if (loadLoop) {
+    for (BasicBlock *BB : loadLoop->blocks()) {
+      if (const MemorySSA::DefsList *defs = MSSA.getBlockDefs(BB)) {
+        for (const MemoryAccess &MA : *defs) {
+          if (const MemoryDef *def = dyn_cast<MemoryDef>(&MA)) {
+            if (clobbers(def)) {
+              return true;
+            }
+          }
         }
-        AST.add(CB);
-      } else if (LoadInst *LI = dyn_cast<LoadInst>(&I)) {
-        AST.add(LI);
-      } else if (AnyMemSetInst *MSI = dyn_cast<AnyMemSetInst>(&I)) {
-        AST.add(MSI);
-      } else if (AnyMemTransferInst *MTI = dyn_cast<AnyMemTransferInst>(&I)) {
-        AST.add(MTI);
       }
     }
   }
 
+  MemoryAccess *original =
+      MSSA.getWalker()->getClobberingMemoryAccess(MSSA.getMemoryAccess(LI));
+
+  SmallPtrSet<MemoryAccess *, 16> visited;
+  SmallVector<MemoryAccess *> worklist = {
+      getMemoryStateBefore(P, MSSA, context.getDomTree())};
+  while (!worklist.empty()) {
+    MemoryAccess *MA = worklist.pop_back_val();
+    if (MA == original || MSSA.isLiveOnEntryDef(MA) ||
+        !visited.insert(MA).second) {
+      continue;
+    }
+    if (visited.size() > ClobberWalkLimit) {
+      return true;
+    }
+    if (loadLoop && loadLoop->contains(MA->getBlock())) {
+      continue;
+    }
+
+    if (MemoryPhi *Phi = dyn_cast<MemoryPhi>(MA)) {
+      for (Value *incoming : Phi->incoming_values()) {
+        worklist.push_back(cast<MemoryAccess>(incoming));
+      }
+    } else {
+      MemoryDef *def = cast<MemoryDef>(MA);
+      if (clobbers(def)) {
+        return true;
+      }
+      worklist.push_back(def->getDefiningAccess());
+    }
+  }
+  return false;
+}
+
+/// Returns the points where the slice may be evaluated: the call site, within
+/// the callee, and the other uses of the slice criterion in the caller, which
+/// are replaced by thunk calls. Uses in PHINodes happen at the end of the
+/// corresponding incoming block.
+static SmallVector<Instruction *> getForcingPoints(Instruction *initial,
+                                                   CallInst *CallSite) {
+  SmallVector<Instruction *> points = {CallSite};
+  for (Use &U : initial->uses()) {
+    Instruction *UserI = dyn_cast<Instruction>(U.getUser());
+    if (!UserI || UserI == CallSite) {
+      continue;
+    }
+    if (PHINode *PN = dyn_cast<PHINode>(UserI)) {
+      points.push_back(PN->getIncomingBlock(U)->getTerminator());
+    } else {
+      points.push_back(UserI);
+    }
+  }
+  return points;
+}
+
+/// When the slice cannot be outlined because of one of its instructions that
+/// dominates the criterion, that instruction is computed eagerly, as it is
+/// without lazification, and the part of the slice that only it needed is
+/// dropped. This is repeated until the rest of the slice can be outlined, or
+/// -wylazy-max-eager-values instructions are computed eagerly.
+bool ProgramSlice::canOutline() {
+  WyvernStageTimer timer("can-outline", "Check slice safety",
+                         _parentFunction->getName());
+  if (isSafeToOutline()) {
+    return true;
+  }
+
+  OutlineRejection rejection = _rejection;
+  while (_eagerValues.size() < WyvernMaxEagerValues) {
+    const Instruction *culprit =
+        dyn_cast_or_null<Instruction>(_rejection.Culprit);
+    if (!culprit || !isInSlice(culprit) || !canCapture(culprit)) {
+      break;
+    }
+    LLVM_DEBUG(dbgs() << "Computing eagerly: " << *culprit << "\n");
+    _eagerValues.push_back(const_cast<Instruction *>(culprit));
+    computeCut();
+    if (isSafeToOutline()) {
+      if (isExpensive()) {
+        LLVM_DEBUG(printSlice());
+        return true;
+      }
+      break;
+    }
+  }
+
+  // Report why the whole slice could not be outlined.
+  _rejection = rejection;
+  if (!_eagerValues.empty()) {
+    _eagerValues.clear();
+    computeCut();
+  }
+  return false;
+}
+
+/// Returns whether the slice does work worth deferring: it calls a function or
+/// runs a loop. Parts of slices that do neither are computed eagerly along
+/// with the rest of the slice.
+bool ProgramSlice::isExpensive() {
+  LoopInfo &LI = _context.getLoopInfo();
+  for (unsigned N : _instsInSlice.set_bits()) {
+    const Instruction *I = _context.getInstruction(N);
+    if (isa<CallBase>(I) && !isa<IntrinsicInst>(I)) {
+      return true;
+    }
+    Loop *L = LI.getLoopFor(I->getParent());
+    if (L && !L->contains(_initial)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Returns whether the slice, as currently cut, can be safely outlined.
+bool ProgramSlice::isSafeToOutline() {
+  LoopInfo &LI = _context.getLoopInfo();
+  SmallVector<Instruction *> forcingPoints =
+      getForcingPoints(_initial, _CallSite);
+
   // LLVM does not provide alias/memory dependence information for allocas.
   // Thus, we track allocas that belong in the slice explicitly, so we can then
   // check if their memory is clobbered (changed) at any point in the slice
   // itself or at some other point in the parent function.
   SmallPtrSet<const Value *, 32> allocasInSlice;
-  for (const Instruction *I : _instsInSlice) {
-    if (const AllocaInst *AI = dyn_cast<AllocaInst>(I)) {
+  for (unsigned N : _instsInSlice.set_bits()) {
+    if (const AllocaInst *AI =
+            dyn_cast<AllocaInst>(_context.getInstruction(N))) {
       allocasInSlice.insert(AI);
     }
   }
 
   for (BasicBlock &BB : *_parentFunction) {
+    if (allocasInSlice.empty()) {
+      break;
+    }
     for (Instruction &I : BB) {
       if (StoreInst *SI = dyn_cast<StoreInst>(&I)) {
         Value *underlying = getUnderlyingObject(SI->getPointerOperand());
         if (allocasInSlice.contains(underlying)) {
-          errs() << "Cannot outline slice because alloca is clobbered: "
-                 << *underlying << "\n";
-          return false;
+          return reject("ClobberedAlloca", "alloca in slice is clobbered",
+                        underlying);
         }
-      } else if (LoadInst *LI = dyn_cast<LoadInst>(&I)) {
-        if (AST.getAliasSetFor(MemoryLocation::get(LI)).isMod()) {
-          Value *underlying = getUnderlyingObject(LI->getPointerOperand());
-          if (allocasInSlice.contains(underlying)) {
-            errs() << "Cannot outline slice because alloca is clobbered: "
-                   << *underlying << "\n";
-            return false;
+      } else if (I.mayWriteToMemory() && &I != _CallSite) {
+        for (const Value *AI : allocasInSlice) {
+          if (isModSet(_AA->getModRefInfo(
+                  &I, MemoryLocation::getBeforeOrAfter(AI)))) {
+            return reject("ClobberedAlloca", "alloca in slice is clobbered",
+                          AI);
           }
         }
       }
     }
   }
 
-  for (const Instruction *I : _instsInSlice) {
+  for (unsigned N : _instsInSlice.set_bits()) {
+    const Instruction *I = _context.getInstruction(N);
     if (I->mayThrow()) {
-      errs() << "Cannot outline slice because inst may throw: " << *I << "\n";
-      return false;
+      return reject("MayThrow", "instruction in slice may throw", I);
     }
 
     if (const CallBase *CB = dyn_cast<CallBase>(I)) {
       if (!CB->getCalledFunction()) {
-        errs() << "Cannot outline slice because instruction calls unknown "
-                  "function: "
-               << *CB << "\n";
-        return false;
+        return reject("UnknownCallee", "slice calls unknown function", CB);
       }
 
       LibFunc builtin;
       if (CB->getCalledFunction()->isDeclaration() &&
           !_TLI.getLibFunc(*CB, builtin)) {
-        errs() << "Cannot outline slice because instruction calls non-builtin "
-                  "function with no body: "
-               << *CB << "\n";
-        return false;
+        return reject("CalleeWithoutBody",
+                      "slice calls non-builtin function with no body", CB);
       }
     }
 
@@ -570,68 +1081,97 @@ bool ProgramSlice::canOutline() {
     // care to avoid load/store reordering and/or side effects.
     if (I->mayReadOrWriteMemory()) {
       if (const LoadInst *LI = dyn_cast<LoadInst>(I)) {
-        // For loads, we invalidate outlining if its address can be modified.
-        // This is possible if the memory location pointed to by the load is
-        // written/modified by any possibly aliasing pointer or clobbering
+        // For loads, we invalidate outlining if its address can be modified
+        // between the load's original position and any point where the slice
+        // may be evaluated, by any possibly aliasing pointer or clobbering
         // function call.
-        if (AST.getAliasSetFor(MemoryLocation::get(LI)).isMod()) {
-          errs()
-              << "Cannot outline slice because load address can be modified: "
-              << *LI << "\n";
-          return false;
+        for (Instruction *P : forcingPoints) {
+          if (mayBeClobberedBeforeForcing(LI, P, _CallSite, _context, *_AA)) {
+            return reject("ClobberedLoad",
+                          "memory read by slice may be modified before the "
+                          "slice is evaluated",
+                          LI);
+          }
         }
 
       } else if (const CallBase *CB = dyn_cast<CallBase>(I)) {
         // For function calls, if the call has any side effects (as in, is not
         // read-only), we can't outline the slice.
         if (!_AA->onlyReadsMemory(CB->getCalledFunction())) {
-          errs() << "Cannot outline because call may write to memory: " << *CB
-                 << "\n";
-          return false;
+          return reject("CallWritesMemory", "call in slice may write to memory",
+                        CB);
         }
       } else {
-        errs() << "Cannot outline because inst may read or write to memory: "
-               << *I << "\n";
-        return false;
+        return reject("AccessesMemory",
+                      "instruction in slice may read or write to memory", I);
       }
     }
 
     else if (!I->willReturn()) {
-      errs() << "Cannot outline because inst may not return: " << *I << "\n";
-      return false;
+      return reject("MayNotReturn", "instruction in slice may not return", I);
     }
+  }
 
+  // Captured pointers are used by the slice like the ones it computes.
+  SmallVector<const Value *> pointersInSlice;
+  for (unsigned N : _instsInSlice.set_bits()) {
+    pointersInSlice.push_back(_context.getInstruction(N));
+  }
+  for (const Value *V : _environment) {
+    if (isa<Instruction>(V)) {
+      pointersInSlice.push_back(V);
+    }
+  }
+  for (const Value *V : pointersInSlice) {
+    if (!V->getType()->isPointerTy()) {
+      continue;
+    }
     for (const Value *arg : _CallSite->args()) {
-      if (arg == _initial) {
+      if (arg == _initial || !arg->getType()->isPointerTy()) {
         continue;
       }
-      if (arg->getType()->isPointerTy() && I->getType()->isPointerTy()) {
-        if (_AA->alias(arg, I) != AliasResult::NoAlias) {
-          errs() << "Cannot outline slice because pointer used in slice is "
-                    "passed as argument to callee.\nPointer: "
-                 << *I << "\nArgument: " << *arg << "\n";
-          return false;
-        }
+      if (_AA->alias(arg, V) != AliasResult::NoAlias) {
+        return reject("PointerPassedToCallee",
+                      "pointer used in slice may alias an argument of the "
+                      "call",
+                      V);
       }
     }
   }
 
-  if (LI.getLoopDepth(_CallSite->getParent()) > 0) {
-    for (const BasicBlock *BB : _BBsInSlice) {
-      if (LI.getLoopDepth(BB) <= LI.getLoopDepth(_CallSite->getParent())) {
-        errs() << "BB " << BB->getName()
-               << " is in same or lower loop depth as CallSite BB "
-               << _CallSite->getParent()->getName() << "\n";
-        return false;
+  // Slices computed outside the call site's loop are loop-invariant: the
+  // thunk is initialized before the loop, and its memoized value is reused by
+  // every iteration. Slices in the call site's loop must be nested deeper.
+  if (Loop *callSiteLoop = LI.getLoopFor(_CallSite->getParent())) {
+    for (unsigned BBN : _BBsInSlice.set_bits()) {
+      const BasicBlock *BB = _context.getBlock(BBN);
+      if (callSiteLoop->contains(BB) &&
+          LI.getLoopDepth(BB) <= callSiteLoop->getLoopDepth()) {
+        return reject("SliceInCallSiteLoop",
+                      "slice block is not nested deeper than the call site's "
+                      "loop",
+                      BB);
+      }
+    }
+
+    // Later iterations may force the thunk after the call site of earlier
+    // ones, so the call site must not modify the memory read by the slice.
+    if (!callSiteLoop->contains(_initial)) {
+      for (unsigned N : _instsInSlice.set_bits()) {
+        const LoadInst *Load = dyn_cast<LoadInst>(_context.getInstruction(N));
+        if (Load && isModSet(_AA->getModRefInfo(_CallSite,
+                                                MemoryLocation::get(Load)))) {
+          return reject("ClobberedInCallSiteLoop",
+                        "memory read by slice may be modified by the call in "
+                        "an earlier iteration",
+                        Load);
+        }
       }
     }
   }
 
   if (isa<AllocaInst>(_initial)) {
-    LLVM_DEBUG(
-        (dbgs()
-         << "Cannot outline slice due to slicing criteria being an alloca!\n"));
-    return false;
+    return reject("AllocaCriterion", "slicing criterion is an alloca", _initial);
   }
 
   // LCSSA may insert PHINodes with only a single incoming block. In some cases,
@@ -641,8 +1181,10 @@ bool ProgramSlice::canOutline() {
   if (PHINode *PN = dyn_cast<PHINode>(_initial)) {
     if (PN->getNumIncomingValues() == 1) {
       BasicBlock *incBB = PN->getIncomingBlock(0);
-      if (_instsInSlice.count(incBB->getTerminator()) == 0) {
-        return false;
+      if (!isInSlice(incBB->getTerminator())) {
+        return reject("LCSSAPhiWithoutBranch",
+                      "single-incoming phi-function's branch is not in slice",
+                      PN);
       }
     }
   }
@@ -650,14 +1192,20 @@ bool ProgramSlice::canOutline() {
   return true;
 }
 
-SmallVector<Value *> ProgramSlice::getOrigFunctionArgs() {
-  SmallVector<Value *> args;
-  for (auto &arg : _depArgs) {
-    args.push_back(cast<Value>(arg));
-  }
-  return args;
+/// Records why the slice cannot be outlined. Returns false, so it can be
+/// returned from canOutline.
+bool ProgramSlice::reject(StringRef key, StringRef reason,
+                          const Value *culprit) {
+  _rejection = {key, reason, culprit};
+  LLVM_DEBUG(dbgs() << "Cannot outline slice: " << reason << ": " << *culprit
+                    << "\n");
+  return false;
 }
 
+unsigned ProgramSlice::size() const { return _instsInSlice.count(); }
+
+SmallVector<Value *> ProgramSlice::getEnvironment() { return _environment; }
+
 /// Inserts a new BasicBlock in Function @param F, corresponding
 /// to the @param originalBB from the original function being
 /// sliced.
@@ -666,28 +1214,30 @@ void ProgramSlice::insertNewBB(const BasicBlock *originalBB, Function *F) {
   std::string newBBName = "sliceclone_" + originalName.str();
   BasicBlock *newBB =
       BasicBlock::Create(F->getParent()->getContext(), newBBName, F);
-  _origToNewBBmap.insert(std::make_pair(originalBB, newBB));
-  _newToOrigBBmap.insert(std::make_pair(newBB, originalBB));
+  _origToNewBBmap[_context.getNumber(originalBB)] = newBB;
+  _newToOrigBBmap[newBB] = originalBB;
 }
 
 /// Populates function @param F with BasicBlocks, corresponding
 /// to the BBs in the original function being sliced which
 /// contained instructions included in the slice.
 void ProgramSlice::populateFunctionWithBBs(Function *F) {
-  for (const BasicBlock *BB : _BBsInSlice) {
-    insertNewBB(BB, F);
+  _origToNewBBmap.assign(_context.getNumBlocks(), nullptr);
+  for (unsigned BBN : _BBsInSlice.set_bits()) {
+    insertNewBB(_context.getBlock(BBN), F);
   }
 }
 
 /// Adds slice instructions to function @param F, corresponding
 /// to instructions in the original function.
 void ProgramSlice::populateBBsWithInsts(Function *F) {
-  for (BasicBlock &BB : *_parentFunction) {
-    for (Instruction &origInst : BB) {
-      if (_instsInSlice.count(&origInst)) {
+  _Imap.assign(_instsInSlice.size(), nullptr);
+  for (unsigned BBN : _BBsInSlice.set_bits()) {
+    IRBuilder<> builder(_origToNewBBmap[BBN]);
+    for (Instruction &origInst : *_context.getBlock(BBN)) {
+      if (isInSlice(&origInst)) {
         Instruction *newInst = origInst.clone();
-        _Imap.insert(std::make_pair(&origInst, newInst));
-        IRBuilder<> builder(_origToNewBBmap[&BB]);
+        _Imap[_context.getNumber(&origInst)] = newInst;
         builder.Insert(newInst);
       }
     }
@@ -700,14 +1250,14 @@ void ProgramSlice::populateBBsWithInsts(Function *F) {
 void ProgramSlice::reorganizeUses(Function *F) {
   IRBuilder<> builder(F->getContext());
 
-  for (auto &pair : _Imap) {
-    Instruction *originalInst = pair.first;
-    Instruction *newInst = pair.second;
+  for (unsigned N : _instsInSlice.set_bits()) {
+    Instruction *originalInst = _context.getInstruction(N);
+    Instruction *newInst = _Imap[N];
 
     if (PHINode *PN = dyn_cast<PHINode>(newInst)) {
       for (BasicBlock *BB : PN->blocks()) {
-        if (_origToNewBBmap.count(BB)) {
-          PN->replaceIncomingBlockWith(BB, _origToNewBBmap[BB]);
+        if (BasicBlock *newBB = getClonedBlock(BB)) {
+          PN->replaceIncomingBlockWith(BB, newBB);
         }
       }
     }
@@ -753,14 +1303,14 @@ void ProgramSlice::reorderBlocks(Function *F) {
 /// Adds a return instruction to function @param F, which returns
 /// the value that is computed by the sliced function.
 ReturnInst *ProgramSlice::addReturnValue(Function *F) {
-  BasicBlock *exit = _Imap[_initial]->getParent();
+  Instruction *newInitial = _Imap[_context.getNumber(_initial)];
+  BasicBlock *exit = newInitial->getParent();
 
   if (exit->getTerminator()) {
     exit->getTerminator()->eraseFromParent();
   }
 
-  return ReturnInst::Create(F->getParent()->getContext(), _Imap[_initial],
-                            exit);
+  return ReturnInst::Create(F->getParent()->getContext(), newInitial, exit);
 }
 
 /// Updates the delegate function's code to make use of parameters provided by
@@ -769,18 +1319,20 @@ void ProgramSlice::insertLoadForThunkParams(Function *F, bool memo) {
   IRBuilder<> builder(F->getContext());
 
   BasicBlock &entry = F->getEntryBlock();
-  Argument *thunkStructPtr = F->arg_begin();
+  Argument *thunkHeaderPtr = F->arg_begin();
   StructType *thunkStructType = getThunkStructType(memo);
 
-  assert(isa<PointerType>(thunkStructPtr->getType()) &&
+  assert(isa<PointerType>(thunkHeaderPtr->getType()) &&
          "Sliced function's first argument does not have struct pointer type!");
 
   builder.SetInsertPoint(&*(entry.getFirstInsertionPt()));
 
-  // memo thunk arguments start at 3, due to the memo flag and memoed value
-  // taking up two slots
-  unsigned int i = memo ? 3 : 1;
-  for (auto &arg : _depArgs) {
+  // The delegate receives a pointer to the thunk's header, which is the
+  // thunk's first field, and the environment follows it.
+  Value *thunkStructPtr = builder.CreateBitCast(
+      thunkHeaderPtr, thunkStructType->getPointerTo(), "_wyvern_thunk");
+  unsigned int i = 1;
+  for (Value *arg : _environment) {
     Value *new_arg_addr =
         builder.CreateStructGEP(thunkStructType, thunkStructPtr, i,
                                 "_wyvern_arg_addr_" + arg->getName());
@@ -797,30 +1349,37 @@ void ProgramSlice::insertLoadForThunkParams(Function *F, bool memo) {
   }
 }
 
+/// Updates the delegate function's code to make use of its parameters, which
+/// hold the environment in the order of the thunk's fields, rather than the
+/// original function's values.
+void ProgramSlice::insertScalarParams(Function *F) {
+  unsigned int i = 0;
+  for (Value *arg : _environment) {
+    Argument *new_arg = F->getArg(i);
+    new_arg->setName("_wyvern_arg_" + arg->getName());
+    arg->replaceUsesWithIf(new_arg, [F](Use &U) {
+      auto *UserI = dyn_cast<Instruction>(U.getUser());
+      return UserI && UserI->getParent()->getParent() == F;
+    });
+
+    _argMap[arg] = new_arg;
+    ++i;
+  }
+}
+
 /// Outlines the given slice into a standalone Function, which
 /// encapsulates the computation of the original value in
 /// regards to which the slice was created.
 Function *ProgramSlice::outline() {
-  StructType *thunkStructType = getThunkStructType(false);
-  PointerType *thunkStructPtrType = thunkStructType->getPointerTo();
-  FunctionType *delegateFunctionType =
-      FunctionType::get(_initial->getType(), {thunkStructPtrType}, false);
-
-  // generate a random number to use as suffix for delegate function, to avoid
-  // naming conflicts
-  // NOTE: we cannot use a simple counter that gets incremented
-  // on every slice here, because when optimizing per translation unit, the same
-  // function may be sliced across different translation units
-  std::random_device rd;
-  std::mt19937 mt(rd());
-  std::uniform_int_distribution<int64_t> dist(1, 1000000000);
-  uint64_t random_num = dist(mt);
-  std::string functionName =
-      "_wyvern_slice_" + _parentFunction->getName().str() + "_" +
-      _initial->getName().str() + std::to_string(random_num);
+  WyvernStageTimer timer("outline", "Outline slices",
+                         _parentFunction->getName());
+  StructType *thunkHeaderType = getThunkHeaderType(_initial->getType(), false);
+  FunctionType *delegateFunctionType = FunctionType::get(
+      _initial->getType(), {thunkHeaderType->getPointerTo()}, false);
+
   Function *F =
-      Function::Create(delegateFunctionType, Function::ExternalLinkage,
-                       functionName, _parentFunction->getParent());
+      Function::Create(delegateFunctionType, Function::InternalLinkage,
+                       "_wyvern_slice", _parentFunction->getParent());
 
   // Let LLVM know that the delegate function is pure, so it can further
   // optimize calls to it
@@ -829,6 +1388,9 @@ Function *ProgramSlice::outline() {
   builder.addAttribute(Attribute::NoUnwind);
   builder.addAttribute(Attribute::WillReturn);
   F->addFnAttrs(builder);
+  // Delegates are only called by Wyvern-generated code, which uses the same
+  // convention for direct calls and calls through thunks.
+  F->setCallingConv(CallingConv::Fast);
 
   F->arg_begin()->setName("_wyvern_thunkptr");
 
@@ -842,14 +1404,57 @@ Function *ProgramSlice::outline() {
   verifyFunction(*F);
   printFunctions(F);
 
-  return F;
+  return nameByStructuralHash(F, "_wyvern_slice_");
+}
+
+/// Outlines the given slice into a standalone Function that takes the
+/// environment as parameters instead of a thunk, so it can be called with
+/// values held in registers.
+Function *ProgramSlice::scalarOutline() {
+  WyvernStageTimer timer("outline", "Outline slices",
+                         _parentFunction->getName());
+  SmallVector<Type *> envTypes;
+  for (Value *arg : _environment) {
+    envTypes.push_back(arg->getType());
+  }
+  FunctionType *delegateFunctionType =
+      FunctionType::get(_initial->getType(), envTypes, false);
+
+  Function *F =
+      Function::Create(delegateFunctionType, Function::InternalLinkage,
+                       "_wyvern_slice_scalar", _parentFunction->getParent());
+
+  // Let LLVM know that the delegate function is pure, so it can further
+  // optimize calls to it
+  AttrBuilder builder(_parentFunction->getContext());
+  builder.addAttribute(Attribute::ReadOnly);
+  builder.addAttribute(Attribute::NoUnwind);
+  builder.addAttribute(Attribute::WillReturn);
+  F->addFnAttrs(builder);
+  F->setCallingConv(CallingConv::Fast);
+
+  populateFunctionWithBBs(F);
+  populateBBsWithInsts(F);
+  reorganizeUses(F);
+  rerouteBranches(F);
+  addReturnValue(F);
+  reorderBlocks(F);
+  insertScalarParams(F);
+  verifyFunction(*F);
+  printFunctions(F);
+
+  return nameByStructuralHash(F, "_wyvern_slice_scalar_");
 }
 
 /// Adds memoization code to the delegate function. This includes the check to
 /// see if its value has been memoized, and the code to update the memoization
-/// cache once invoked.
-void ProgramSlice::addMemoizationCode(Function *F, ReturnInst *new_ret) {
-  StructType *thunkStructType = getThunkStructType(true);
+/// cache once invoked. Memoized thunks have no flag: once the value is cached,
+/// the thunk's fptr is replaced with @param memoizedValueDelegate, which
+/// returns it. Forcing the thunk through its fptr then skips the delegate, and
+/// direct calls to the delegate compare the fptr to find the cached value.
+void ProgramSlice::addMemoizationCode(Function *F, ReturnInst *new_ret,
+                                      Function *memoizedValueDelegate) {
+  StructType *thunkHeaderType = getThunkHeaderType(_initial->getType(), true);
   IRBuilder<> builder(F->getContext());
   LLVMContext &Ctx = F->getParent()->getContext();
 
@@ -863,20 +1468,21 @@ void ProgramSlice::addMemoizationCode(Function *F, ReturnInst *new_ret) {
   BasicBlock *memoRetBlock =
       BasicBlock::Create(Ctx, "_wyvern_memo_ret", F, oldEntry);
 
-  // load addresses and values for memo flag and memoed value
+  // load addresses and values for the delegate and memoed value
   Value *argValue = F->arg_begin();
   builder.SetInsertPoint(newEntry);
-  Value *memoedValueGEP = builder.CreateStructGEP(thunkStructType, argValue, 1,
+  Value *memoedValueGEP = builder.CreateStructGEP(thunkHeaderType, argValue, 1,
                                                   "_wyvern_memo_val_addr");
   LoadInst *memoedValueLoad =
-      builder.CreateLoad(thunkStructType->getStructElementType(1),
+      builder.CreateLoad(thunkHeaderType->getStructElementType(1),
                          memoedValueGEP, "_wyvern_memo_val");
 
-  Value *memoFlagGEP = builder.CreateStructGEP(thunkStructType, argValue, 2,
-                                               "_wyvern_memo_flag_addr");
-  LoadInst *memoFlagLoad =
-      builder.CreateLoad(thunkStructType->getStructElementType(2), memoFlagGEP,
-                         "_wyvern_memo_flag");
+  Value *fptrGEP = builder.CreateStructGEP(thunkHeaderType, argValue, 0,
+                                           "_wyvern_thunk_fptr_addr");
+  LoadInst *fptrLoad = builder.CreateLoad(
+      thunkHeaderType->getStructElementType(0), fptrGEP, "_wyvern_thunk_fptr");
+  Value *isMemoized = builder.CreateICmpEQ(fptrLoad, memoizedValueDelegate,
+                                           "_wyvern_memo_flag");
 
   if (_thunkDebugging) {
     std::string dbg_fmt;
@@ -884,57 +1490,51 @@ void ProgramSlice::addMemoizationCode(Function *F, ReturnInst *new_ret) {
     raw_string_ostream rso(dbg_fmt);
 
     rso << "== Wyvern Debugging ==\nEvaluating thunk!\n";
-    rso << "\ti1 memo_flag = %d\n";
-    debug_args.push_back(memoFlagLoad);
+    rso << "\tmemoized = %d\n";
+    debug_args.push_back(builder.CreateZExt(isMemoized, builder.getInt32Ty()));
     rso << "======================\n";
     generatePrintf(dbg_fmt, debug_args, builder);
   }
 
-  // add if (memoFlag == true) { return memo_val; }
-  Value *toBool = builder.CreateTruncOrBitCast(
-      memoFlagLoad, builder.getInt1Ty(), "_wyvern_memo_flag_bool");
-  BranchInst *memoCheckBranch =
-      builder.CreateCondBr(toBool, memoRetBlock, oldEntry);
+  // add if (fptr == memoizedValueDelegate) { return memo_val; }
+  builder.CreateCondBr(isMemoized, memoRetBlock, oldEntry);
 
   builder.SetInsertPoint(memoRetBlock);
-  ReturnInst *memoedValueRet = builder.CreateRet(memoedValueLoad);
+  builder.CreateRet(memoedValueLoad);
 
-  // store computed value and update memoization flag
+  // store computed value, then mark the thunk as memoized
   builder.SetInsertPoint(new_ret);
-  builder.CreateStore(builder.getInt1(1), memoFlagGEP);
   builder.CreateStore(new_ret->getReturnValue(), memoedValueGEP);
+  builder.CreateStore(memoizedValueDelegate, fptrGEP);
 }
 
 /// Outlines the given slice into a standalone Function, which
 /// encapsulates the computation of the original value in
 /// regards to which the slice was created. Adds memoization
 /// code so that the function saves its evaluated value and
-/// returns it on successive executions.
-Function *ProgramSlice::memoizedOutline() {
-  StructType *thunkStructType = getThunkStructType(true);
-  PointerType *thunkStructPtrType = thunkStructType->getPointerTo();
-  FunctionType *delegateFunctionType =
-      FunctionType::get(_initial->getType(), {thunkStructPtrType}, false);
-
-  std::random_device rd;
-  std::mt19937 mt(rd());
-  std::uniform_int_distribution<int64_t> dist(1, 1000000000);
-  uint64_t random_num = dist(mt);
+/// returns it on successive executions. @param memoizedValueDelegate returns
+/// the value cached in a memoized thunk of the slice's type.
+Function *ProgramSlice::memoizedOutline(Function *memoizedValueDelegate) {
+  WyvernStageTimer timer("outline", "Outline slices",
+                         _parentFunction->getName());
+  StructType *thunkHeaderType = getThunkHeaderType(_initial->getType(), true);
+  FunctionType *delegateFunctionType = FunctionType::get(
+      _initial->getType(), {thunkHeaderType->getPointerTo()}, false);
 
-  std::string functionName =
-      "_wyvern_slice_memo_" + _parentFunction->getName().str() + "_" +
-      _initial->getName().str() + std::to_string(random_num);
   Function *F =
-      Function::Create(delegateFunctionType, Function::ExternalLinkage,
-                       functionName, _parentFunction->getParent());
+      Function::Create(delegateFunctionType, Function::InternalLinkage,
+                       "_wyvern_slice_memo", _parentFunction->getParent());
 
-  // Let LLVM know that the delegate function is pure, so it can further
-  // optimize calls to it
+  // The memoized delegate writes its value and fptr back to the thunk, so,
+  // unlike the other delegates, it is not read-only. Its slice may read any
+  // memory, so it is not argmemonly either.
   AttrBuilder builder(_parentFunction->getContext());
-  builder.addAttribute(Attribute::ReadOnly);
   builder.addAttribute(Attribute::NoUnwind);
   builder.addAttribute(Attribute::WillReturn);
   F->addFnAttrs(builder);
+  // Delegates are only called by Wyvern-generated code, which uses the same
+  // convention for direct calls and calls through thunks.
+  F->setCallingConv(CallingConv::Fast);
 
   F->arg_begin()->setName("_wyvern_thunkptr");
 
@@ -945,12 +1545,12 @@ Function *ProgramSlice::memoizedOutline() {
   ReturnInst *new_ret = addReturnValue(F);
   reorderBlocks(F);
   insertLoadForThunkParams(F, true /*memo*/);
-  addMemoizationCode(F, new_ret);
+  addMemoizationCode(F, new_ret, memoizedValueDelegate);
 
   verifyFunction(*F);
   verifyFunction(*_initial->getParent()->getParent());
 
   printFunctions(F);
 
-  return F;
+  return nameByStructuralHash(F, "_wyvern_slice_memo_");
 }
@@ -1,43 +1,205 @@
 #include <map>
+#include <memory>
 #include <set>
 
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/PostDominators.h"
 
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 
+#include <unordered_map>
+
 namespace llvm {
 
+/// Maps each basic block to the predicates (gates) that control its
+/// phi-functions.
+using GatesMap =
+    std::unordered_map<const BasicBlock *, SmallVector<const Value *>>;
+
+/// Backward slice of a value in a function: the instructions and blocks it
+/// depends on, indexed by their numbers in the slicing context, and the
+/// arguments it depends on, indexed by argument number.
+struct SliceDependences {
+  BitVector Insts;
+  BitVector Blocks;
+  BitVector Args;
+};
+
+/// Returns the header of the thunks whose delegates return @param valueType.
+/// Headers have the form:
+///   T (fptr)(header *thk);
+///   T memo_val;       (memoized thunks only)
+/// Memoized thunks whose value is cached point to a delegate that returns
+/// memo_val, so they need no separate flag.
+/// A thunk is its header followed by its environment, and delegates take a
+/// pointer to the header, so code that only forces thunks, like callee clones,
+/// is shared by every slice with the same type.
+StructType *getThunkHeaderType(Type *valueType, bool memo);
+
+/// Per-function information used to slice a function: its dominator and
+/// post-dominator trees, loops, gates and memory SSA. It is computed once per
+/// function and shared by the slices of all call sites in that function.
+///
+/// Lazification only inserts instructions in the functions it slices, without
+/// changing their CFG, so the trees, loops and gates remain valid as call sites
+/// are lazified. The inserted instructions only access thunks, which never
+/// alias the memory read by slices, so memory SSA does not need to track them.
+///
+/// Blocks and instructions are numbered densely, in layout order, so slices
+/// can be kept as bit vectors and clone maps as flat arrays. Instructions
+/// inserted after the context is built are numbered when first requested.
+///
+/// Slices are computed from a program dependence graph over the numbered
+/// instructions, whose edges are data dependences and, for phi-functions,
+/// gates. Slices are cached until the instructions they were computed from
+/// change, which must be reported through updateDependences.
+class SlicingContext {
+public:
+  /// Computes the control flow information for function @param F. Only reads
+  /// the IR, so contexts for different functions may be built concurrently.
+  SlicingContext(Function &F);
+
+  Function &getFunction() { return _F; }
+  DominatorTree &getDomTree() { return _DT; }
+  PostDominatorTree &getPostDomTree() { return _PDT; }
+  LoopInfo &getLoopInfo() { return _LI; }
+  const GatesMap &getGates() { return _gates; }
+
+  unsigned getNumBlocks() const { return _blocks.size(); }
+  unsigned getNumInstructions() const { return _insts.size(); }
+  BasicBlock *getBlock(unsigned N) const { return _blocks[N]; }
+  Instruction *getInstruction(unsigned N) const { return _insts[N]; }
+
+  /// Returns the number of block @param BB, which must belong to the function.
+  unsigned getNumber(const BasicBlock *BB) const;
+
+  /// Returns the number of instruction @param I, which must belong to the
+  /// function, numbering it if it was inserted after the context was built.
+  unsigned getNumber(const Instruction *I);
+
+  /// Returns the backward slice of instruction @param I.
+  const SliceDependences &getSlice(Instruction *I);
+
+  /// Computes the slices of all instructions in @param criteria together. The
+  /// dependence graph is traversed once for all of them, so overlapping slices
+  /// cost about as much as their union.
+  void computeSlices(ArrayRef<Instruction *> criteria);
+
+  /// Returns the backward slice of instruction @param I, cut at the
+  /// instructions for which @param isCaptured returns true. Their dependences
+  /// are not traversed, and they are added to @param captured rather than to
+  /// the slice, but their blocks are kept, so the control flow around them is
+  /// preserved. Cut slices are not cached.
+  SliceDependences
+  getSliceWithCut(Instruction *I, function_ref<bool(Instruction *)> isCaptured,
+                  SmallVectorImpl<Instruction *> &captured);
+
+  /// Returns the number of instructions in the backward slice of instruction
+  /// @param I, counting at most @param limit of them.
+  unsigned countDependences(Instruction *I, unsigned limit);
+
+  /// Updates the dependences of instructions @param changed, whose operands
+  /// were modified, and drops the cached slices.
+  void updateDependences(ArrayRef<Instruction *> changed);
+
+  /// Returns the memory SSA form of the function, built with alias analysis
+  /// @param AA the first time it is requested.
+  MemorySSA &getMemorySSA(AAResults &AA);
+
+private:
+  Function &_F;
+  DominatorTree _DT;
+  PostDominatorTree _PDT;
+  LoopInfo _LI;
+  GatesMap _gates;
+
+  SmallVector<BasicBlock *> _blocks;
+  DenseMap<const BasicBlock *, unsigned> _blockNumbers;
+  SmallVector<Instruction *> _insts;
+  DenseMap<const Instruction *, unsigned> _instNumbers;
+
+  /// Dependence graph node of an instruction: the instructions it depends on
+  /// and the blocks and arguments that any slice containing it must include.
+  struct DependenceNode {
+    SmallVector<unsigned, 4> Insts;
+    SmallVector<unsigned, 2> Blocks;
+    SmallVector<unsigned, 1> Args;
+  };
+  void buildDependenceNode(unsigned N);
+
+  std::vector<DependenceNode> _pdg;
+  DenseMap<const Instruction *, std::unique_ptr<SliceDependences>> _slices;
+
+  std::unique_ptr<MemorySSA> _MSSA;
+};
+
+/// Reason why a slice cannot be outlined: an identifier, used as the name of
+/// optimization remarks, a description, and the value responsible for it.
+struct OutlineRejection {
+  StringRef Key;
+  StringRef Reason;
+  const Value *Culprit = nullptr;
+};
+
 class ProgramSlice {
 public:
   /// Creates a backward slice of function F in terms of slice criterion I,
-  /// which is passed as a parameter in call CallSite. Optionally, receives the
-  /// result of an Alias Analysis in AA to perform memory safety analysis.
-  ProgramSlice(Instruction &I, Function &F, CallInst &CallSite, AAResults *AA,
-               TargetLibraryInfo &TLI, bool thunkDebugging);
+  /// which is passed as a parameter in call CallSite. The per-function
+  /// information used for slicing is taken from @param context, which must
+  /// describe F. Optionally, receives the result of an Alias Analysis in AA to
+  /// perform memory safety analysis.
+  ProgramSlice(Instruction &I, Function &F, CallInst &CallSite,
+               SlicingContext &context, AAResults *AA, TargetLibraryInfo &TLI,
+               bool thunkDebugging);
 
   /// Returns whether the slice can be safely outlined into a delegate function.
+  /// If it cannot, instructions that keep it from being outlined are computed
+  /// eagerly instead, and captured in the environment, as long as the rest of
+  /// the slice can be outlined and is still worth deferring.
   bool canOutline();
 
-  /// Returns the set of arguments of the slice's parent function. Used to
-  /// initialize the environment for thunks that use the slice as their delegate
-  /// function.
-  SmallVector<Value *> getOrigFunctionArgs();
+  /// Returns the instructions of the slice computed eagerly by canOutline.
+  ArrayRef<Instruction *> getEagerValues() const { return _eagerValues; }
+
+  /// Returns why the slice cannot be outlined, after canOutline fails.
+  const OutlineRejection &getRejection() const { return _rejection; }
+
+  /// Returns the number of instructions in the slice.
+  unsigned size() const;
+
+  /// Returns the values of the slice's parent function that the slice takes
+  /// as inputs: formal arguments and captured instructions. Used to initialize
+  /// the environment for thunks that use the slice as their delegate function.
+  SmallVector<Value *> getEnvironment();
 
   /// Returns the struct type of the slice's corresponding thunk used for
-  /// lazification.
+  /// lazification: its header, followed by its environment. Thunk types are
+  /// literal structs, so slices with the same layout share them.
   StructType *getThunkStructType(bool memo = false);
 
   /// Returns the delegate function resulted from outlining the slice.
   Function *outline();
 
+  /// Returns the delegate function resulted from outlining the slice, taking
+  /// the environment as parameters, in the order of getEnvironment, rather than
+  /// in a thunk.
+  Function *scalarOutline();
+
   /// Returns the delegate function resulted from outlining the slice, using
-  /// memoization.
-  Function *memoizedOutline();
+  /// memoization. Once it caches its value, it replaces itself in the thunk
+  /// with @param memoizedValueDelegate, which must return memo_val.
+  Function *memoizedOutline(Function *memoizedValueDelegate);
 
 private:
   void insertLoadForThunkParams(Function *F, bool memo);
+  void insertScalarParams(Function *F);
   void printFunctions(Function *F);
   void reorderBlocks(Function *F);
   void rerouteBranches(Function *F);
@@ -46,13 +208,24 @@ private:
   void populateBBsWithInsts(Function *F);
   void populateFunctionWithBBs(Function *F);
   void addMissingTerminators(Function *F);
-  void addMemoizationCode(Function *F, ReturnInst *new_ret);
+  void addMemoizationCode(Function *F, ReturnInst *new_ret,
+                          Function *memoizedValueDelegate);
   void insertNewBB(const BasicBlock *originalBB, Function *F);
   void printSlice();
   void computeAttractorBlocks();
-  void addDomBranches(DomTreeNode *cur, DomTreeNode *parent,
-                      std::set<DomTreeNode *> &visited);
+  void addDomBranches(DomTreeNode *root, DomTreeNode *parent,
+                      BitVector &visited);
+  bool isInSlice(const Instruction *I);
+  bool isInSlice(const BasicBlock *BB) const;
+  BasicBlock *getClonedBlock(const BasicBlock *BB) const;
+  const BasicBlock *getAttractor(const BasicBlock *BB) const;
   StructType *computeStructType(bool memo);
+  void computeCut();
+  bool canCapture(const Instruction *I);
+  bool shouldCapture(Instruction *I, const SliceDependences &deps);
+  bool isSafeToOutline();
+  bool isExpensive();
+  bool reject(StringRef key, StringRef reason, const Value *culprit);
 
   /// pointer to the Instruction used as slice criterion
   Instruction *_initial;
@@ -60,41 +233,49 @@ private:
   /// function being sliced
   Function *_parentFunction;
 
-  /// list of formal arguments on which the slice depends on (if any)
-  SmallVector<Argument *> _depArgs;
+  /// values on which the slice depends on (if any): formal arguments, and
+  /// instructions that the parent function computes anyway, which are
+  /// captured in the environment instead of being recomputed by the slice
+  SmallVector<Value *> _environment;
+
+  /// instructions of the slice that cannot be outlined, which are computed
+  /// eagerly and captured in the environment
+  SmallVector<Instruction *> _eagerValues;
 
   /// set of instructions that must be in the slice, accordingto dependence
-  /// analysis
-  std::set<const Instruction *> _instsInSlice;
+  /// analysis, indexed by their number in the slicing context
+  BitVector _instsInSlice;
 
   /// set of BasicBLocks that must be in the slice, according to dependence
-  /// analysis
-  std::set<const BasicBlock *> _BBsInSlice;
+  /// analysis, indexed by their number in the slicing context
+  BitVector _BBsInSlice;
 
   /// function call being lazified
   CallInst *_CallSite;
 
+  /// per-function information shared by all slices of the parent function
+  SlicingContext &_context;
+
   // @_Imap ->
-  /// maps each BasicBlock to its attractor (its first  dominator), used for
-  /// rearranging control flow
-  std::map<const BasicBlock *, const BasicBlock *> _attractors;
+  /// maps each BasicBlock (by number) to its attractor (its first
+  /// dominator), used for rearranging control flow
+  SmallVector<const BasicBlock *> _attractors;
 
-  /// maps original function arguments to new counterparts in the slice function
-  std::map<Argument *, Value *> _argMap;
+  /// maps environment values to their new counterparts in the slice function
+  std::map<Value *, Value *> _argMap;
 
-  /// maps BasicBlocks in the original function to their new cloned counterparts
-  /// in the slice
-  std::map<const BasicBlock *, BasicBlock *> _origToNewBBmap;
+  /// maps BasicBlocks in the original function (by number) to their new cloned
+  /// counterparts in the slice
+  SmallVector<BasicBlock *> _origToNewBBmap;
 
   /// same as above, but in the opposite direction
-  std::map<BasicBlock *, const BasicBlock *> _newToOrigBBmap;
+  DenseMap<BasicBlock *, const BasicBlock *> _newToOrigBBmap;
 
-  /// maps Instructions in the original function to their cloned counterparts in
-  /// the slice
-  std::map<Instruction *, Instruction *> _Imap;
+  /// maps Instructions in the original function (by number) to their cloned
+  /// counterparts in the slice
+  SmallVector<Instruction *> _Imap;
 
-  /// We store the slice's thunk types, because LLVM does not cache types based
-  /// on structure
+  /// The slice's thunk types, with and without memoization
   StructType *_thunkStructType;
   StructType *_memoizedThunkStructType;
 
@@ -106,5 +287,8 @@ private:
   TargetLibraryInfo &_TLI;
 
   bool _thunkDebugging;
+
+  /// why the slice cannot be outlined, set when canOutline fails
+  OutlineRejection _rejection;
 };
 } // namespace llvm
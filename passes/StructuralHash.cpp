@@ -0,0 +1,321 @@
+#include "StructuralHash.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+namespace {
+/// Feeds the structure of a function into an MD5 hash. Debug intrinsics are
+/// skipped, so the hash does not depend on debug information, which refers to
+/// the rest of the module.
+class FunctionHasher {
+public:
+  explicit FunctionHasher(const Function &F) : _F(F) {
+    unsigned next = 0;
+    for (const Argument &arg : F.args()) {
+      _numbers[&arg] = next++;
+    }
+    for (const BasicBlock &BB : F) {
+      _numbers[&BB] = next++;
+      for (const Instruction &I : BB.instructionsWithoutDebug()) {
+        _numbers[&I] = next++;
+      }
+    }
+  }
+
+  std::string hash() {
+    addType(_F.getFunctionType());
+    addAttributes(_F.getAttributes());
+    addInt(_F.getCallingConv());
+    for (const BasicBlock &BB : _F) {
+      addInt(BB.sizeWithoutDebug());
+      for (const Instruction &I : BB.instructionsWithoutDebug()) {
+        addInstruction(I);
+      }
+    }
+
+    MD5::MD5Result result;
+    _hash.final(result);
+    return result.digest().str().str();
+  }
+
+private:
+  void addInt(uint64_t value) {
+    _hash.update(makeArrayRef(reinterpret_cast<const uint8_t *>(&value),
+                              sizeof(value)));
+  }
+
+  void addString(StringRef str) {
+    addInt(str.size());
+    _hash.update(str);
+  }
+
+  template <typename T> void addPrinted(const T &printable) {
+    std::string str;
+    raw_string_ostream os(str);
+    printable.print(os);
+    addString(os.str());
+  }
+
+  void addType(Type *type) {
+    // Named structs are hashed by their body, and numbered in order of
+    // appearance to hash recursive types.
+    if (auto *ST = dyn_cast<StructType>(type); ST && !ST->isLiteral()) {
+      auto [it, inserted] = _structs.try_emplace(ST, _structs.size());
+      addInt(Type::StructTyID);
+      addInt(it->second);
+      if (!inserted) {
+        return;
+      }
+      if (ST->isOpaque()) {
+        addString(ST->getName());
+        return;
+      }
+    }
+
+    addInt(type->getTypeID());
+    if (auto *IT = dyn_cast<IntegerType>(type)) {
+      addInt(IT->getBitWidth());
+    } else if (auto *PT = dyn_cast<PointerType>(type)) {
+      addInt(PT->getAddressSpace());
+    } else if (auto *AT = dyn_cast<ArrayType>(type)) {
+      addInt(AT->getNumElements());
+    } else if (auto *VT = dyn_cast<VectorType>(type)) {
+      addInt(VT->getElementCount().getKnownMinValue());
+    } else if (auto *FT = dyn_cast<FunctionType>(type)) {
+      addInt(FT->isVarArg());
+    } else if (auto *ST = dyn_cast<StructType>(type)) {
+      addInt(ST->isPacked());
+    }
+    addInt(type->getNumContainedTypes());
+    for (Type *subtype : type->subtypes()) {
+      addType(subtype);
+    }
+  }
+
+  void addAttributes(AttributeList attrs) {
+    std::string str;
+    raw_string_ostream os(str);
+    for (unsigned index : attrs.indexes()) {
+      os << index << ':' << attrs.getAttributes(index).getAsString() << ';';
+    }
+    addString(os.str());
+  }
+
+  void addInstruction(const Instruction &I) {
+    addInt(I.getOpcode());
+    addInt(I.getRawSubclassOptionalData());
+    addType(I.getType());
+
+    if (const auto *cmp = dyn_cast<CmpInst>(&I)) {
+      addInt(cmp->getPredicate());
+    } else if (const auto *load = dyn_cast<LoadInst>(&I)) {
+      addInt(load->isVolatile());
+      addInt(load->getAlign().value());
+      addInt(static_cast<unsigned>(load->getOrdering()));
+    } else if (const auto *store = dyn_cast<StoreInst>(&I)) {
+      addInt(store->isVolatile());
+      addInt(store->getAlign().value());
+      addInt(static_cast<unsigned>(store->getOrdering()));
+    } else if (const auto *alloca = dyn_cast<AllocaInst>(&I)) {
+      addType(alloca->getAllocatedType());
+      addInt(alloca->getAlign().value());
+    } else if (const auto *GEP = dyn_cast<GetElementPtrInst>(&I)) {
+      addType(GEP->getSourceElementType());
+    } else if (const auto *call = dyn_cast<CallBase>(&I)) {
+      addType(call->getFunctionType());
+      addAttributes(call->getAttributes());
+      addInt(call->getCallingConv());
+    } else if (const auto *extract = dyn_cast<ExtractValueInst>(&I)) {
+      for (unsigned index : extract->indices()) {
+        addInt(index);
+      }
+    } else if (const auto *insert = dyn_cast<InsertValueInst>(&I)) {
+      for (unsigned index : insert->indices()) {
+        addInt(index);
+      }
+    }
+
+    if (const auto *phi = dyn_cast<PHINode>(&I)) {
+      for (const BasicBlock *incoming : phi->blocks()) {
+        addOperand(incoming);
+      }
+    }
+    for (const Value *op : I.operand_values()) {
+      addOperand(op);
+    }
+  }
+
+  void addOperand(const Value *op) {
+    auto local = _numbers.find(op);
+    if (local != _numbers.end()) {
+      addInt(0);
+      addInt(local->second);
+    } else if (const auto *GV = dyn_cast<GlobalValue>(op)) {
+      addInt(1);
+      addString(GV->getName());
+      addType(GV->getValueType());
+      if (const auto *callee = dyn_cast<Function>(GV)) {
+        addAttributes(callee->getAttributes());
+      }
+    } else if (const auto *CI = dyn_cast<ConstantInt>(op)) {
+      addInt(2);
+      addType(CI->getType());
+      addString(toString(CI->getValue(), 16, /*Signed=*/false));
+    } else if (const auto *CFP = dyn_cast<ConstantFP>(op)) {
+      addInt(3);
+      addType(CFP->getType());
+      addString(toString(CFP->getValueAPF().bitcastToAPInt(), 16,
+                         /*Signed=*/false));
+    } else if (isa<ConstantPointerNull>(op) || isa<ConstantAggregateZero>(op) ||
+               isa<UndefValue>(op)) {
+      addInt(4);
+      addInt(op->getValueID());
+      addType(op->getType());
+    } else if (const auto *CE = dyn_cast<ConstantExpr>(op)) {
+      addInt(5);
+      addInt(CE->getOpcode());
+      addType(CE->getType());
+      if (CE->isCompare()) {
+        addInt(CE->getPredicate());
+      }
+      for (const Value *ceOp : CE->operand_values()) {
+        addOperand(ceOp);
+      }
+    } else if (const auto *CA = dyn_cast<ConstantAggregate>(op)) {
+      addInt(6);
+      addType(CA->getType());
+      for (const Value *element : CA->operand_values()) {
+        addOperand(element);
+      }
+    } else if (const auto *CDS = dyn_cast<ConstantDataSequential>(op)) {
+      addInt(7);
+      addType(CDS->getType());
+      addString(CDS->getRawDataValues());
+    } else if (const auto *MAV = dyn_cast<MetadataAsValue>(op)) {
+      addInt(8);
+      addMetadata(MAV->getMetadata());
+    } else {
+      addInt(9);
+      addPrinted(*op);
+    }
+  }
+
+  /// Metadata is hashed by structure rather than printed, since printing
+  /// numbers nodes across the whole module.
+  void addMetadata(const Metadata *MD) {
+    if (const auto *str = dyn_cast<MDString>(MD)) {
+      addInt(0);
+      addString(str->getString());
+    } else if (const auto *VAM = dyn_cast<ValueAsMetadata>(MD)) {
+      addInt(1);
+      addOperand(VAM->getValue());
+    } else if (const auto *node = dyn_cast<MDNode>(MD)) {
+      // Nodes are numbered in order of appearance to hash cycles.
+      auto [it, inserted] = _nodes.try_emplace(node, _nodes.size());
+      addInt(2);
+      addInt(it->second);
+      if (!inserted) {
+        return;
+      }
+      addInt(node->getMetadataID());
+      addInt(node->getNumOperands());
+      for (const MDOperand &nodeOp : node->operands()) {
+        if (nodeOp) {
+          addMetadata(nodeOp.get());
+        } else {
+          addInt(3);
+        }
+      }
+    } else {
+      addInt(4);
+      addInt(MD->getMetadataID());
+    }
+  }
+
+  const Function &_F;
+  DenseMap<const Value *, unsigned> _numbers;
+  DenseMap<const StructType *, unsigned> _structs;
+  DenseMap<const MDNode *, unsigned> _nodes;
+  MD5 _hash;
+};
+} // namespace
+
+std::string llvm::computeFunctionHash(const Function &F) {
+  return FunctionHasher(F).hash();
+}
+
+/// Returns whether function @param F refers to a global with local linkage,
+/// which may be a different symbol in each module.
+static bool referencesLocalSymbols(const Function &F) {
+  SmallVector<const Constant *> worklist;
+  SmallPtrSet<const Constant *, 16> visited;
+  auto push = [&](const Value *V) {
+    const auto *C = dyn_cast<Constant>(V);
+    if (C && visited.insert(C).second) {
+      worklist.push_back(C);
+    }
+  };
+
+  for (const Instruction &I : instructions(F)) {
+    for (const Value *op : I.operand_values()) {
+      push(op);
+    }
+  }
+  while (!worklist.empty()) {
+    const Constant *C = worklist.pop_back_val();
+    if (const auto *GV = dyn_cast<GlobalValue>(C)) {
+      if (GV->hasLocalLinkage()) {
+        return true;
+      }
+      continue;
+    }
+    for (const Value *op : C->operand_values()) {
+      push(op);
+    }
+  }
+  return false;
+}
+
+Function *llvm::nameByStructuralHash(Function *F, StringRef prefix) {
+  Module *M = F->getParent();
+  std::string name = (prefix + computeFunctionHash(*F)).str();
+
+  Function *existing = M->getFunction(name);
+  if (existing && existing != F && !existing->isDeclaration() &&
+      existing->getFunctionType() == F->getFunctionType()) {
+    F->eraseFromParent();
+    return existing;
+  }
+
+  F->setName(name);
+  return F;
+}
+
+void llvm::setGeneratedFunctionLinkage(Function &F, bool foldAcrossModules) {
+  if (!foldAcrossModules || referencesLocalSymbols(F)) {
+    F.setComdat(nullptr);
+    F.setLinkage(GlobalValue::InternalLinkage);
+    return;
+  }
+
+  // Hidden, so that the copies are only folded within a linked image and are
+  // not exported from shared libraries.
+  F.setLinkage(GlobalValue::LinkOnceODRLinkage);
+  F.setVisibility(GlobalValue::HiddenVisibility);
+  Module *M = F.getParent();
+  if (Triple(M->getTargetTriple()).supportsCOMDAT()) {
+    F.setComdat(M->getOrInsertComdat(F.getName()));
+  }
+}
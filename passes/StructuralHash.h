@@ -0,0 +1,33 @@
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+
+#include <string>
+
+namespace llvm {
+
+/// Returns a structural hash of function @param F, as a hex string. The hash
+/// covers the function's signature and attributes, and, for each instruction,
+/// its opcode, flags, types and operands. Local operands are hashed by their
+/// position in the function and global ones by name, along with the type and
+/// attributes of called functions, so that changes to @param F, or to the
+/// declared behavior of its callees, change the hash. The bodies of other
+/// functions are not covered, so results that may depend on them, such as
+/// alias queries answered by GlobalsAA, must not be cached under it. Types are
+/// hashed by structure, so the numbering of named struct types in a module
+/// does not change the hash.
+std::string computeFunctionHash(const Function &F);
+
+/// Names function @param F, generated by Wyvern, @param prefix followed by its
+/// structural hash, so builds are reproducible. If the module already has a
+/// function with the same name and type, @param F is erased and that function
+/// is returned instead.
+Function *nameByStructuralHash(Function *F, StringRef prefix);
+
+/// Sets the linkage of function @param F, generated by Wyvern. With
+/// @param foldAcrossModules, if @param F only refers to symbols that are
+/// visible from other modules, it is given hidden linkonce_odr linkage, in a
+/// COMDAT on targets that support them, so linkers fold the identical copies
+/// emitted by different modules. Otherwise, it is given internal linkage, so
+/// its attributes can be inferred and it is removed once unused.
+void setGeneratedFunctionLinkage(Function &F, bool foldAcrossModules);
+} // namespace llvm
@@ -0,0 +1,90 @@
+/// This file exposes the Wyvern passes as a new pass manager plugin, so they
+/// can be loaded with `opt -load-pass-plugin` or `clang -fpass-plugin`. The
+/// legacy pass manager registration lives alongside each pass.
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+
+#include "FindLazyfiable.h"
+#include "Instrumentation.h"
+#include "ProgramSlice.h"
+#include "Lazyfication.h"
+
+using namespace llvm;
+
+/// Adds lazification to @param MPM, for the whole program at link time if
+/// @param wholeProgram is set. Since we explicitly run LCSSA during our
+/// analyses, there may be leftover invalid PHINodes created by it in the
+/// program. We must then run -instcombine explicitly to remove them (as LLVM
+/// itself does behind the scenes).
+static void addLazificationPasses(ModulePassManager &MPM,
+                                  bool wholeProgram = false) {
+  MPM.addPass(LazyficationPass(wholeProgram));
+  MPM.addPass(createModuleToFunctionPassAdaptor(InstCombinePass()));
+}
+
+static void registerWyvernPasses(PassBuilder &PB) {
+  PB.registerAnalysisRegistrationCallback([](ModuleAnalysisManager &MAM) {
+    MAM.registerPass([] { return FindLazyfiableAnalysis(); });
+  });
+
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, ModulePassManager &MPM,
+         ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "lazify-callsites") {
+          MPM.addPass(LazyficationPass());
+          return true;
+        }
+        if (Name == "wyinstr-instrument") {
+          MPM.addPass(InstrumentationPass());
+          return true;
+        }
+        return false;
+      });
+
+  // Run at the start of the default per-module (and LTO pre-link) pipelines,
+  // before the inliner and the function simplification passes, which would
+  // otherwise fold callees into their callers and leave nothing to lazify.
+  // Lazification canonicalizes the IR it needs by itself. This is earlier
+  // than the legacy EP_ModuleOptimizerEarly registration, which runs after
+  // the inliner.
+  PB.registerPipelineStartEPCallback(
+      [](ModulePassManager &MPM, OptimizationLevel Level) {
+        if (Level == OptimizationLevel::O0) {
+          return;
+        }
+        addLazificationPasses(MPM);
+      });
+
+  // The pipeline start extension point does not apply to ThinLTO backends,
+  // which lazify call sites to the callees they imported. Their promising
+  // arguments were recorded when compiling their own modules, and they are
+  // only available before the inliner and EliminateAvailableExternally, so
+  // this runs right after the early simplification passes. Other modules have
+  // no imported callees and are left alone.
+  PB.registerPipelineEarlySimplificationEPCallback(
+      [](ModulePassManager &MPM, OptimizationLevel Level) {
+        if (Level == OptimizationLevel::O0) {
+          return;
+        }
+        MPM.addPass(LazyficationPass(/*wholeProgram=*/false,
+                                     /*importedCalleesOnly=*/true));
+      });
+
+#if LLVM_VERSION_MAJOR >= 15
+  // Equivalent of the legacy EP_FullLinkTimeOptimizationEarly registration.
+  // The extension point only exists in the new pass manager from LLVM 15 on.
+  PB.registerFullLinkTimeOptimizationEarlyEPCallback(
+      [](ModulePassManager &MPM, OptimizationLevel Level) {
+        MPM.addPass(InstrumentationPass());
+        addLazificationPasses(MPM, /*wholeProgram=*/true);
+      });
+#endif
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Wyvern", LLVM_VERSION_STRING,
+          registerWyvernPasses};
+}
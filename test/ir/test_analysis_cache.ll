@@ -0,0 +1,68 @@
+; With -wylazy-cache-dir, the results of the analyses are written to the cache
+; and read back by later runs, which lazify the same call sites. Cache files
+; record the options that change the results, and files written with other
+; values are overwritten rather than reused. Only rejected slices are cached,
+; since whether a slice can be outlined may depend on other functions.
+;
+; RUN: rm -rf %t
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-cache-dir=%t %s | FileCheck %s
+; RUN: cat %t/*.wyvern | FileCheck %s --check-prefix=FILE
+; RUN: grep -h ^outline %t/*.wyvern | FileCheck %s --check-prefix=VERDICTS
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-cache-dir=%t %s | FileCheck %s
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-cache-dir=%t -wylazy-memo=false %s | FileCheck %s
+; RUN: cat %t/*.wyvern | FileCheck %s --check-prefix=NOMEMO
+
+; CHECK-LABEL: define i32 @caller(
+; CHECK: call fastcc i32 @_wyvern_calleeclone_callee_1_
+; CHECK-LABEL: define i32 @rejected(
+; CHECK: call i32 @callee(i32 %k, i32 %x)
+
+; FILE: wyvern-cache 5 wylazy-memo=1 wylazy-adaptive-memo=1 wylazy-pgo=0
+; FILE-SAME: wylazy-capture-min-size=2
+; VERDICTS-NOT: outline
+; VERDICTS: outline {{[0-9]+}} 1 0 MayThrow
+; VERDICTS-NOT: outline
+; NOMEMO-NOT: wylazy-memo=1
+; NOMEMO: wyvern-cache 5 wylazy-memo=0
+
+define internal i32 @callee(i32 %a, i32 %b) {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %b
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define i32 @caller(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  %r = call i32 @callee(i32 %k, i32 %x)
+  ret i32 %r
+}
+
+define i32 @rejected(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @opaque(i32 %n)
+  %r = call i32 @callee(i32 %k, i32 %x)
+  ret i32 %r
+}
+
+declare i32 @opaque(i32)
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
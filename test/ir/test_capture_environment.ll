@@ -0,0 +1,64 @@
+; The caller computes %base for another use anyway, so it is captured in the
+; thunk's environment and the delegate only recomputes %x from it. With a
+; -wylazy-capture-min-size above the size of the slice of %base, or with
+; capturing disabled, the delegate recomputes %base from %n instead.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-scalar-env-size=0 %s | FileCheck %s
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-scalar-env-size=0 -wylazy-capture-min-size=3 %s | FileCheck %s --check-prefix=NOCAPTURE
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-scalar-env-size=0 -wylazy-capture-min-size=0 %s | FileCheck %s --check-prefix=NOCAPTURE
+
+; CHECK-LABEL: define i32 @caller(
+; CHECK: %_wyvern_thunk_alloca = alloca { %_wyvern_thunk_header.i32, i32 }
+; CHECK: store i32 (%_wyvern_thunk_header.i32*)* @[[SLICE:_wyvern_slice_[0-9a-f]+]]
+; CHECK: store i32 %base, i32* %_wyvern_thunk_arg_gep_base
+; CHECK-NEXT: call fastcc i32 @_wyvern_calleeclone_callee_1_{{[0-9a-f]+}}(i32 %k, %_wyvern_thunk_header.i32* %_wyvern_thunk)
+; CHECK: define {{.*}} @[[SLICE]](
+; CHECK: %_wyvern_arg_base = load i32, i32* %_wyvern_arg_addr_base
+; CHECK-NEXT: %0 = call i32 @expensive(i32 %_wyvern_arg_base)
+; CHECK-NEXT: ret i32 %0
+
+; NOCAPTURE-LABEL: define i32 @caller(
+; NOCAPTURE: store i32 (%_wyvern_thunk_header.i32*)* @[[SLICE:_wyvern_slice_[0-9a-f]+]]
+; NOCAPTURE-NOT: store i32 %base
+; NOCAPTURE: store i32 %n, i32* %_wyvern_thunk_arg_gep_n
+; NOCAPTURE-NEXT: call fastcc i32 @_wyvern_calleeclone_callee_1_{{[0-9a-f]+}}(i32 %k, %_wyvern_thunk_header.i32* %_wyvern_thunk)
+; NOCAPTURE: define {{.*}} @[[SLICE]](
+; NOCAPTURE: %0 = add i32 %_wyvern_arg_n, 1
+; NOCAPTURE-NEXT: %1 = call i32 @expensive(i32 %0)
+; NOCAPTURE-NEXT: %2 = call i32 @expensive(i32 %1)
+; NOCAPTURE-NEXT: ret i32 %2
+
+define internal i32 @callee(i32 %a, i32 %b) {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %a
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define i32 @caller(i32 %n, i32 %k) {
+entry:
+  %a = add i32 %n, 1
+  %base = call i32 @expensive(i32 %a)
+  %x = call i32 @expensive(i32 %base)
+  %r = call i32 @callee(i32 %k, i32 %x)
+  %s = add i32 %r, %base
+  ret i32 %s
+}
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
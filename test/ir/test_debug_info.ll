@@ -0,0 +1,76 @@
+; Calls that force a thunk get a location in the scope of their function when
+; it has debug information, so inlining the delegate gives the slice locations
+; inlined at that call rather than locations in the caller's scope, which the
+; verifier rejects. The uses in @callee have no locations of their own.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites %s | FileCheck %s
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -disable-output -passes='lazify-callsites,inline' -wylazy-scalar-env-size=0 %s
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -disable-output -passes='lazify-callsites,inline' -wylazy-inline-delegate-size=0 %s
+
+; CHECK: define {{.*}} @_wyvern_calleeclone_callee_1_{{[0-9a-f]+}}({{.*}}) {{.*}}!dbg ![[SP:[0-9]+]]
+; CHECK: call i32 @expensive(i32 %_wyvern_arg_n) {{.*}}!dbg ![[LOC:[0-9]+]]
+; CHECK-DAG: ![[LOC]] = !DILocation(line: 11, scope: !{{[0-9]+}}, inlinedAt: ![[AT:[0-9]+]])
+; CHECK-DAG: ![[AT]] = distinct !DILocation(line: 0, scope: ![[SP]])
+
+define internal i32 @callee(i32 %a, i32 %b) !dbg !10 {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %a
+  %t1 = icmp sgt i32 %r, 10
+  br i1 %t1, label %again, label %end
+again:
+  %r2 = add i32 %r, %b
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ], [ %r2, %again ]
+  ret i32 %res
+}
+
+define i32 @caller(i32 %n, i32 %k) !dbg !11 {
+entry:
+  %x = call i32 @expensive(i32 %n), !dbg !13
+  %r = call i32 @callee(i32 %k, i32 %x), !dbg !14
+  ret i32 %r, !dbg !14
+}
+
+define i32 @eager(i32 %k) !dbg !15 {
+entry:
+  %r = call i32 @callee(i32 %k, i32 3), !dbg !16
+  ret i32 %r, !dbg !16
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn !dbg !30 {
+entry:
+  br label %loop, !dbg !31
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i, !dbg !31
+  %inc = add i32 %i, 1, !dbg !31
+  %c = icmp slt i32 %inc, %n, !dbg !31
+  br i1 %c, label %loop, label %done, !dbg !31
+done:
+  ret i32 %s2, !dbg !31
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!2}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, emissionKind: FullDebug)
+!1 = !DIFile(filename: "test.c", directory: "/")
+!2 = !{i32 2, !"Debug Info Version", i32 3}
+!3 = !DISubroutineType(types: !4)
+!4 = !{}
+!10 = distinct !DISubprogram(name: "callee", scope: !1, file: !1, line: 1, type: !3, spFlags: DISPFlagDefinition, unit: !0)
+!11 = distinct !DISubprogram(name: "caller", scope: !1, file: !1, line: 10, type: !3, spFlags: DISPFlagDefinition, unit: !0)
+!13 = !DILocation(line: 11, scope: !11)
+!14 = !DILocation(line: 12, scope: !11)
+!15 = distinct !DISubprogram(name: "eager", scope: !1, file: !1, line: 15, type: !3, spFlags: DISPFlagDefinition, unit: !0)
+!16 = !DILocation(line: 16, scope: !15)
+!20 = !DILocation(line: 2, scope: !10)
+!21 = !DILocation(line: 3, scope: !10)
+!22 = !DILocation(line: 4, scope: !10)
+!30 = distinct !DISubprogram(name: "expensive", scope: !1, file: !1, line: 30, type: !3, spFlags: DISPFlagDefinition, unit: !0)
+!31 = !DILocation(line: 31, scope: !30)
@@ -0,0 +1,54 @@
+; Callee clones hoist the forces of a loop to its preheader only when the loop
+; exits, and every exit passes the force. The loop in @callee never exits, so
+; hoisting would force the thunk even on executions that never reach %use.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites %s | FileCheck %s
+
+; CHECK-LABEL: define void @caller(
+; CHECK: call fastcc void @[[CLONE:_wyvern_calleeclone_callee_1_[0-9a-f]+]](
+; CHECK: define {{.*}} void @[[CLONE]](
+; CHECK-NOT: call i32 @expensive
+; CHECK: use:
+; CHECK: call i32 @expensive
+
+@sink = global i32 0
+
+define internal void @callee(i32 %a, i32 %b) {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %spin, label %end
+spin:
+  %i = phi i32 [ 0, %entry ], [ %i2, %latch ]
+  %c = icmp eq i32 %i, %a
+  br i1 %c, label %use, label %latch
+use:
+  store volatile i32 %b, i32* @sink
+  br label %latch
+latch:
+  %i2 = add i32 %i, 1
+  store volatile i32 %i2, i32* @sink
+  br label %spin
+end:
+  ret void
+}
+
+define void @caller(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  call void @callee(i32 %k, i32 %x)
+  ret void
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
@@ -0,0 +1,74 @@
+; Cache entries are keyed by a structural hash that skips debug intrinsics, so
+; functions compiled with debug information keep their entries when the rest
+; of the module changes. Uncommenting @unrelated, which adds a subprogram to
+; the module's debug information, keeps the entry of @caller.
+;
+; RUN: rm -rf %t
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -disable-output -passes=lazify-callsites -wylazy-cache-dir=%t/plain %s
+; RUN: mkdir -p %t && sed 's/^;EXTRA //' %s > %t/extra.ll
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -disable-output -passes=lazify-callsites -wylazy-cache-dir=%t/extra %t/extra.ll
+; RUN: ls %t/plain | FileCheck %s --check-prefix=PLAIN
+; RUN: for f in %t/plain/*.wyvern; do test -e %t/extra/$(basename $f); done
+
+; PLAIN-COUNT-3: .wyvern
+
+;EXTRA define i32 @unrelated(i32 %n) !dbg !20 {
+;EXTRA entry:
+;EXTRA   call void @llvm.dbg.value(metadata i32 %n, metadata !21, metadata !DIExpression()), !dbg !22
+;EXTRA   ret i32 %n, !dbg !22
+;EXTRA }
+
+define internal i32 @callee(i32 %a, i32 %b) !dbg !10 {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %b
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define i32 @caller(i32 %n, i32 %k) !dbg !11 {
+entry:
+  call void @llvm.dbg.value(metadata i32 %n, metadata !12, metadata !DIExpression()), !dbg !13
+  %x = call i32 @expensive(i32 %n), !dbg !13
+  call void @llvm.dbg.value(metadata i32 %x, metadata !14, metadata !DIExpression()), !dbg !13
+  %r = call i32 @callee(i32 %k, i32 %x), !dbg !13
+  ret i32 %r, !dbg !13
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
+
+declare void @llvm.dbg.value(metadata, metadata, metadata)
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!2}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, emissionKind: FullDebug)
+!1 = !DIFile(filename: "test.c", directory: "/")
+!2 = !{i32 2, !"Debug Info Version", i32 3}
+!3 = !DISubroutineType(types: !4)
+!4 = !{}
+!5 = !DIBasicType(name: "int", size: 32, encoding: DW_ATE_signed)
+!10 = distinct !DISubprogram(name: "callee", scope: !1, file: !1, line: 1, type: !3, unit: !0)
+!11 = distinct !DISubprogram(name: "caller", scope: !1, file: !1, line: 10, type: !3, unit: !0)
+!12 = !DILocalVariable(name: "n", arg: 1, scope: !11, file: !1, line: 10, type: !5)
+!13 = !DILocation(line: 11, scope: !11)
+!14 = !DILocalVariable(name: "x", scope: !11, file: !1, line: 11, type: !5)
+;EXTRA !20 = distinct !DISubprogram(name: "unrelated", scope: !1, file: !1, line: 20, type: !3, unit: !0)
+;EXTRA !21 = !DILocalVariable(name: "n", arg: 1, scope: !20, file: !1, line: 20, type: !5)
+;EXTRA !22 = !DILocation(line: 21, scope: !20)
@@ -0,0 +1,69 @@
+; Callees imported by ThinLTO (available_externally) are lazified according to
+; the promising arguments recorded in their !wyvern.promising metadata, which
+; must match their signature. @stale's metadata was recorded for a function
+; with three arguments, so it is ignored and @stale is analyzed again, while
+; @recorded's metadata, which says it has no promising arguments, is trusted.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites %s | FileCheck %s
+
+; CHECK-LABEL: define i32 @call_recorded(
+; CHECK: call i32 @recorded(i32 %k, i32 %x)
+; CHECK-LABEL: define i32 @call_stale(
+; CHECK-NOT: call i32 @stale(
+; CHECK: call fastcc i32 @_wyvern_calleeclone_
+
+define available_externally i32 @recorded(i32 %a, i32 %b) !wyvern.promising !0 {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %b
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define available_externally i32 @stale(i32 %a, i32 %b) !wyvern.promising !1 {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %b
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define i32 @call_recorded(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  %r = call i32 @recorded(i32 %k, i32 %x)
+  ret i32 %r
+}
+
+define i32 @call_stale(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  %r = call i32 @stale(i32 %k, i32 %x)
+  ret i32 %r
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
+
+!0 = !{i32 2}
+!1 = !{i32 3, !2}
+!2 = !{i32 0, i32 undef}
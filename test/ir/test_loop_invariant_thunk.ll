@@ -0,0 +1,59 @@
+; A call site in a loop whose argument is computed before the loop passes the
+; same thunk in every iteration. The thunk is initialized once, before the
+; loop, and stays memoized even though the callee forces it at most once per
+; call, so the slice is evaluated at most once per execution of the loop.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites %s | FileCheck %s
+
+; CHECK-LABEL: define i32 @caller(
+; CHECK: entry:
+; CHECK: %_wyvern_thunk_alloca = alloca { %_wyvern_thunk_memo_header.i32, i32 }
+; CHECK: store i32 (%_wyvern_thunk_memo_header.i32*)* @[[MEMO:_wyvern_slice_memo_[0-9a-f]+]]
+; CHECK: store i32 %n, i32* %_wyvern_thunk_arg_gep_n
+; CHECK-NEXT: br label %loop
+; CHECK: loop:
+; CHECK-NOT: store
+; CHECK: call fastcc i32 @_wyvern_calleeclone_callee_1_{{[0-9a-f]+}}(i32 %i, %_wyvern_thunk_memo_header.i32* %_wyvern_thunk)
+; CHECK: define {{.*}} @[[MEMO]](
+
+define internal i32 @callee(i32 %a, i32 %b) {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %a
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define i32 @caller(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc2, %loop ]
+  %r = call i32 @callee(i32 %i, i32 %x)
+  %acc2 = add i32 %acc, %r
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %k
+  br i1 %c, label %loop, label %exit
+exit:
+  ret i32 %acc2
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
@@ -0,0 +1,65 @@
+; Memoized delegates write their value back to the thunk, and callee clones
+; force it, so neither may keep a read-only attribute, even when the callee
+; was inferred to be readnone. Calls redirected to the clones drop them too,
+; so dead store elimination keeps the stores that initialize the thunk.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites %s | FileCheck %s
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes='lazify-callsites,function(dse)' -wylazy-scalar-env-size=0 %s | FileCheck %s --check-prefix=DSE
+
+; CHECK: define {{.*}} @_wyvern_slice_memo_{{[0-9a-f]+}}({{.*}}) #[[MEMO:[0-9]+]]
+; CHECK: define {{.*}} @_wyvern_calleeclone_callee_1_{{[0-9a-f]+}}({{.*}}) #[[CLONE:[0-9]+]]
+; CHECK-DAG: attributes #[[MEMO]] = { nounwind willreturn }
+; CHECK-DAG: attributes #[[CLONE]] = { {{[a-z ]*}}nounwind willreturn }
+
+; DSE-LABEL: define i32 @readnone_caller(
+; DSE: store i32 (%_wyvern_thunk_header.i32*)* @_wyvern_slice_
+; DSE: store i32 %n
+; DSE: call fastcc i32 @_wyvern_calleeclone_callee_1_{{[0-9a-f]+}}(i32 %k, %_wyvern_thunk_header.i32* %_wyvern_thunk){{$}}
+
+define internal i32 @callee(i32 %a, i32 %b) {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %a
+  %t1 = icmp sgt i32 %r, 10
+  br i1 %t1, label %again, label %end
+again:
+  %r2 = add i32 %r, %b
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ], [ %r2, %again ]
+  ret i32 %res
+}
+
+define i32 @caller(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  %y = add i32 %x, 1
+  %r = call i32 @callee(i32 %k, i32 %x)
+  %s = add i32 %r, %y
+  ret i32 %s
+}
+
+define i32 @readnone_caller(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  %r = call i32 @callee(i32 %k, i32 %x) #0
+  ret i32 %r
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
+
+attributes #0 = { readnone }
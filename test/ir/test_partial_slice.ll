@@ -0,0 +1,72 @@
+; The load of @g in the slice of %x may be modified by the store before the
+; call, so the slice cannot be outlined as a whole. The load is computed
+; eagerly instead and captured in the slice's environment, and the rest of the
+; slice is lazified. The cache does not record that verdict, since only
+; rejections are cached. With -wylazy-max-eager-values=0, nothing is computed
+; eagerly and the call site is not lazified, even after a cached run.
+;
+; RUN: rm -rf %t
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites %s | FileCheck %s
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-cache-dir=%t %s | FileCheck %s
+; RUN: cat %t/*.wyvern | FileCheck %s --check-prefix=FILE
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-cache-dir=%t %s | FileCheck %s
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-cache-dir=%t -wylazy-max-eager-values=0 %s | FileCheck %s --check-prefix=NOEAGER
+
+; CHECK-LABEL: define i32 @caller(
+; CHECK: %c = load i32, i32* @g
+; CHECK: store i32 0, i32* @g
+; CHECK: call fastcc i32 @[[CLONE:_wyvern_calleeclone_callee_1_[0-9a-f]+]](i32 %k, i32 %n, i32 %c)
+; CHECK: define {{.*}} @[[CLONE]](i32 %a, i32 %_wyvern_arg_n, i32 %_wyvern_arg_c)
+; CHECK-NOT: load
+; CHECK: use:
+; CHECK-NEXT: [[M:%[0-9]+]] = add i32 %_wyvern_arg_n, %_wyvern_arg_c
+; CHECK-NEXT: call i32 @expensive(i32 [[M]])
+
+; FILE: wylazy-max-eager-values=4
+; FILE-NOT: outline
+
+; NOEAGER-LABEL: define i32 @caller(
+; NOEAGER-NOT: _wyvern_calleeclone
+; NOEAGER: call i32 @callee(i32 %k, i32 %x)
+
+@g = global i32 7
+
+define internal i32 @callee(i32 %a, i32 %b) {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %a
+  %t1 = icmp sgt i32 %r, 10
+  br i1 %t1, label %again, label %end
+again:
+  %r2 = add i32 %r, %b
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ], [ %r2, %again ]
+  ret i32 %res
+}
+
+define i32 @caller(i32 %n, i32 %k) {
+entry:
+  %c = load i32, i32* @g
+  %m = add i32 %n, %c
+  %x = call i32 @expensive(i32 %m)
+  store i32 0, i32* @g
+  %r = call i32 @callee(i32 %k, i32 %x)
+  ret i32 %r
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
@@ -0,0 +1,61 @@
+; When the lazified value has no other use and its environment is small, the
+; environment is passed to the callee clone as extra parameters instead of a
+; thunk, and the clone computes the value in registers, once for both uses.
+; The clone may read memory to compute it, so the new call does not keep the
+; readnone attribute of the original one.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites %s | FileCheck %s
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-scalar-env-size=0 %s | FileCheck %s --check-prefix=THUNK
+
+; CHECK-LABEL: define i32 @caller(
+; CHECK-NOT: alloca
+; CHECK: call fastcc i32 @[[CLONE:_wyvern_calleeclone_callee_1_[0-9a-f]+]](i32 %k, i32 %n){{$}}
+; CHECK: define {{.*}} i32 @[[CLONE]](i32 %a, i32 %_wyvern_arg_n)
+; CHECK-NOT: alloca
+; CHECK: use:
+; CHECK-NEXT: [[V:%[0-9]+]] = call i32 @expensive(i32 %_wyvern_arg_n)
+; CHECK: again:
+; CHECK-NEXT: add i32 %r, [[V]]
+; CHECK-NOT: call i32 @expensive
+
+; THUNK-LABEL: define i32 @caller(
+; THUNK: %_wyvern_thunk_alloca = alloca { %_wyvern_thunk_header.i32, i32 }
+; THUNK: call fastcc i32 @_wyvern_calleeclone_callee_1_{{[0-9a-f]+}}(i32 %k, %_wyvern_thunk_header.i32* %_wyvern_thunk)
+
+define internal i32 @callee(i32 %a, i32 %b) {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %a
+  %t1 = icmp sgt i32 %a, 10
+  br i1 %t1, label %again, label %end
+again:
+  %r2 = add i32 %r, %b
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ], [ %r2, %again ]
+  ret i32 %res
+}
+
+define i32 @caller(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  %r = call i32 @callee(i32 %k, i32 %x) #0
+  ret i32 %r
+}
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
+
+attributes #0 = { readnone }
@@ -0,0 +1,69 @@
+; ThinLTO backends lazify call sites to the callees they imported, which are
+; available_externally and carry the promising arguments recorded when their
+; own module was compiled. This happens in the default ThinLTO backend
+; pipeline, before the imported definitions are dropped. @local is defined in
+; this module, whose call sites were lazified when it was compiled, so the
+; backend leaves them alone.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes='thinlto<O2>' %s | FileCheck %s
+
+; CHECK-LABEL: define i32 @call_imported(
+; CHECK: call fastcc i32 @_wyvern_calleeclone_imported_1_
+; CHECK-LABEL: define i32 @call_local(
+; CHECK: call i32 @local(
+; CHECK-NOT: define available_externally
+
+define available_externally i32 @imported(i32 %a, i32 %b) noinline !wyvern.promising !0 {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %a
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define i32 @local(i32 %a, i32 %b) noinline {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %a
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define i32 @call_imported(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  %r = call i32 @imported(i32 %k, i32 %x)
+  ret i32 %r
+}
+
+define i32 @call_local(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  %r = call i32 @local(i32 %k, i32 %x)
+  ret i32 %r
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn noinline {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
+
+!0 = !{i32 2, !1}
+!1 = !{i32 1, i32 undef}
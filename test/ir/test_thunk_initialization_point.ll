@@ -0,0 +1,112 @@
+; The thunk is initialized at the nearest common dominator of the uses of the
+; lazified argument, moved out of the loops that do not compute it, and only
+; gets lifetime markers around the call when the call site is its only use and
+; no loop iteration reuses it.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites %s | FileCheck %s
+
+; The thunk is hoisted out of the loop, so it stays live across iterations.
+; CHECK-LABEL: define i32 @loop_caller(
+; CHECK-NOT: llvm.lifetime
+; CHECK: store i32 %n, i32* %_wyvern_thunk_arg_gep_n
+; CHECK-NEXT: br label %loop
+; CHECK-NOT: llvm.lifetime
+
+; The call site and the other use of %x are both dominated by %split, but not
+; by each other, so the thunk is initialized at the end of %split.
+; CHECK-LABEL: define i32 @branch_caller(
+; CHECK-NOT: llvm.lifetime
+; CHECK-NOT: store
+; CHECK: split:
+; CHECK-NEXT: getelementptr
+; CHECK-NEXT: getelementptr
+; CHECK-NEXT: store i32 (%_wyvern_thunk_memo_header.i32*)* @[[MEMO:_wyvern_slice_memo_[0-9a-f]+]]
+; CHECK-NEXT: getelementptr
+; CHECK-NEXT: store i32 %n, i32* %_wyvern_thunk_arg_gep_n
+; CHECK-NEXT: br i1 %q, label %lazy, label %eager
+; CHECK: lazy:
+; CHECK-NEXT: call fastcc i32 @_wyvern_calleeclone_callee_1_{{[0-9a-f]+}}(i32 %k, %_wyvern_thunk_memo_header.i32* %_wyvern_thunk)
+; CHECK: eager:
+; CHECK-NEXT: %_wyvern_thunkcall = call fastcc i32 @[[MEMO]](%_wyvern_thunk_memo_header.i32* %_wyvern_thunk)
+; CHECK-NOT: llvm.lifetime
+
+; The only use is the call site, so the thunk is sunk into %lazy and is only
+; live around the call.
+; CHECK-LABEL: define i32 @single_caller(
+; CHECK-NOT: store
+; CHECK: lazy:
+; CHECK-NEXT: bitcast
+; CHECK-NEXT: call void @llvm.lifetime.start.p0i8(i64 16,
+; CHECK: store i32 %n, i32* %_wyvern_thunk_arg_gep_n
+; CHECK-NEXT: call fastcc i32 @_wyvern_calleeclone_callee_1_{{[0-9a-f]+}}(i32 %k, %_wyvern_thunk_header.i32* %_wyvern_thunk)
+; CHECK-NEXT: bitcast
+; CHECK-NEXT: call void @llvm.lifetime.end.p0i8(i64 16,
+
+define internal i32 @callee(i32 %a, i32 %b) {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %r = mul i32 %b, %a
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define i32 @loop_caller(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc2, %loop ]
+  %r = call i32 @callee(i32 %i, i32 %x)
+  %acc2 = add i32 %acc, %r
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %k
+  br i1 %c, label %loop, label %exit
+exit:
+  ret i32 %acc2
+}
+
+define i32 @branch_caller(i32 %n, i32 %k, i1 %p, i1 %q) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  br i1 %p, label %split, label %early
+early:
+  ret i32 0
+split:
+  br i1 %q, label %lazy, label %eager
+lazy:
+  %r = call i32 @callee(i32 %k, i32 %x)
+  ret i32 %r
+eager:
+  %y = add i32 %x, 1
+  ret i32 %y
+}
+
+define i32 @single_caller(i32 %n, i32 %k, i1 %p) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  br i1 %p, label %lazy, label %early
+early:
+  ret i32 0
+lazy:
+  %r = call i32 @callee(i32 %k, i32 %x)
+  ret i32 %r
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
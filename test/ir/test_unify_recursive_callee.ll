@@ -0,0 +1,59 @@
+; With -wylazy-unify-callees, the eager call sites of a lazified internal callee
+; pass pre-forced thunks to its clone. The recursive call within the callee is
+; redirected as well, so the original callee has no uses left and is removed.
+;
+; RUN: opt -load %wyvern -load-pass-plugin %wyvern -S -passes=lazify-callsites -wylazy-unify-callees %s | FileCheck %s
+
+; CHECK-NOT: define internal i32 @callee(
+; CHECK-LABEL: define i32 @caller(
+; CHECK: store i32 (%_wyvern_thunk_header.i32*)* @_wyvern_slice_{{[0-9a-f]+}}
+; CHECK: call fastcc i32 @[[CLONE:_wyvern_calleeclone_callee_1_[0-9a-f]+]](i32 %k, %_wyvern_thunk_header.i32* %_wyvern_thunk)
+; CHECK-LABEL: define i32 @eager(
+; CHECK: store i32 (%_wyvern_thunk_header.i32*)* @[[FORCED:_wyvern_thunk_forced_[0-9a-f]+]], i32 (%_wyvern_thunk_header.i32*)** %_wyvern_thunk_fptr_gep
+; CHECK: store i32 %b, i32* %_wyvern_thunk_val_gep
+; CHECK: call fastcc i32 @[[CLONE]](i32 %a, %_wyvern_thunk_header.i32* %_wyvern_forced_thunk)
+; CHECK: define internal fastcc i32 @[[CLONE]](
+; CHECK: store i32 (%_wyvern_thunk_header.i32*)* @[[FORCED]]
+; CHECK: %rec = call fastcc i32 @[[CLONE]](i32 %a1, %_wyvern_thunk_header.i32* %_wyvern_forced_thunk)
+; CHECK-NOT: define internal i32 @callee(
+
+define internal i32 @callee(i32 %a, i32 %b) {
+entry:
+  %t0 = icmp sgt i32 %a, 5
+  br i1 %t0, label %use, label %end
+use:
+  %a1 = sub i32 %a, 1
+  %rec = call i32 @callee(i32 %a1, i32 %b)
+  %r = mul i32 %rec, %b
+  br label %end
+end:
+  %res = phi i32 [ 0, %entry ], [ %r, %use ]
+  ret i32 %res
+}
+
+define i32 @caller(i32 %n, i32 %k) {
+entry:
+  %x = call i32 @expensive(i32 %n)
+  %r = call i32 @callee(i32 %k, i32 %x)
+  ret i32 %r
+}
+
+define i32 @eager(i32 %a, i32 %b) {
+entry:
+  %r = call i32 @callee(i32 %a, i32 %b)
+  ret i32 %r
+}
+
+define i32 @expensive(i32 %n) readonly nounwind willreturn {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %loop ]
+  %s2 = add i32 %s, %i
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %done
+done:
+  ret i32 %s2
+}
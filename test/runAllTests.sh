@@ -25,3 +25,24 @@ for f in ${TEST_FILES}; do
 		opt -load ../build/passes/libWyvern.so -S -mem2reg -mergereturn -function-attrs -loop-simplify -lcssa -enable-new-pm=0 -lazify-callsites -wylazy-memo=${MEMO_FLAG} -instcombine -stats test.ll -o test_lazyfied.ll
 	fi
 done
+
+# The IR fixtures in ir/ are run through the RUN lines they carry, whose output
+# is checked with FileCheck. %s stands for the fixture, %t for a temporary path
+# and %wyvern for the Wyvern library.
+WYVERN_LIB=${WYVERN_LIB:-../build/passes/libWyvern.so}
+FILECHECK=${FILECHECK:-FileCheck}
+failed=0
+for f in $(find ir -name "*.ll" | sort); do
+	echo "========= Checking ${f} ========="
+	while read -r cmd; do
+		cmd=${cmd//%wyvern/${WYVERN_LIB}}
+		cmd=${cmd//%s/${f}}
+		cmd=${cmd//%t/${TMPDIR:-/tmp}/wyvern-$(basename ${f} .ll)}
+		cmd=${cmd//FileCheck/${FILECHECK}}
+		if ! bash -o pipefail -c "${cmd}"; then
+			echo "FAILED: ${cmd}"
+			failed=1
+		fi
+	done < <(sed -n 's/^; RUN: //p' "${f}")
+done
+exit ${failed}